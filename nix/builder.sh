@@ -1,7 +1,8 @@
 source $setup
 
 cmake-cross $src \
-  -DCMAKE_INSTALL_PREFIX=$out
+  -DCMAKE_INSTALL_PREFIX=$out \
+  -DLIBPLOAD_SHARED=FALSE
 
 make
 make install
@@ -0,0 +1,113 @@
+#include "blank_scan.h"
+#include <cstring>
+#include <cassert>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BLANK_SCAN_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#define BLANK_SCAN_NEON
+#include <arm_neon.h>
+#endif
+
+// The number of bytes we check at once.
+#define BLANK_SCAN_CHUNK_SIZE 16
+
+// Returns true if every byte is 0xFF.  The size must be a multiple of
+// BLANK_SCAN_CHUNK_SIZE.  We AND the chunks together and only check the
+// result at the end, since almost every block we scan is either blank or
+// has non-blank data near its start.
+static inline bool chunksAreBlank(const uint8_t * data, size_t size)
+{
+#if defined(BLANK_SCAN_SSE2)
+    const __m128i ones = _mm_set1_epi8((char)0xFF);
+    __m128i result = ones;
+    for (size_t i = 0; i < size; i += BLANK_SCAN_CHUNK_SIZE)
+    {
+        result = _mm_and_si128(result,
+            _mm_loadu_si128((const __m128i *)(data + i)));
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(result, ones)) == 0xFFFF;
+#elif defined(BLANK_SCAN_NEON)
+    uint8x16_t result = vdupq_n_u8(0xFF);
+    for (size_t i = 0; i < size; i += BLANK_SCAN_CHUNK_SIZE)
+    {
+        result = vandq_u8(result, vld1q_u8(data + i));
+    }
+    uint64x2_t words = vreinterpretq_u64_u8(result);
+    return (vgetq_lane_u64(words, 0) & vgetq_lane_u64(words, 1)) == UINT64_MAX;
+#else
+    uint64_t result = UINT64_MAX;
+    for (size_t i = 0; i < size; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        result &= word;
+    }
+    return result == UINT64_MAX;
+#endif
+}
+
+bool memoryIsBlank(const uint8_t * data, size_t size)
+{
+    size_t chunkedSize = size - size % BLANK_SCAN_CHUNK_SIZE;
+    if (!chunksAreBlank(data, chunkedSize)) { return false; }
+    for (size_t i = chunkedSize; i < size; i++)
+    {
+        if (data[i] != 0xFF) { return false; }
+    }
+    return true;
+}
+
+// Scans blocks whose size is known at compile time, so the compiler can
+// unroll the loop in chunksAreBlank.
+template <uint32_t blockSize>
+static void scanBlocks(const uint8_t * data, size_t size,
+    std::vector<bool> & nonBlank)
+{
+    static_assert(blockSize % BLANK_SCAN_CHUNK_SIZE == 0,
+        "Block size must be a multiple of the chunk size.");
+
+    size_t blockCount = size / blockSize;
+    for (size_t i = 0; i < blockCount; i++)
+    {
+        nonBlank[i] = !chunksAreBlank(data + i * blockSize, blockSize);
+    }
+}
+
+std::vector<bool> findNonBlankBlocks(const uint8_t * data, size_t size,
+    uint32_t blockSize)
+{
+    assert(blockSize != 0);
+
+    std::vector<bool> nonBlank((size + blockSize - 1) / blockSize);
+
+    size_t fullBlocksSize = size - size % blockSize;
+    switch (blockSize)
+    {
+    case 64:
+        // The write block size of all our bootloaders.
+        scanBlocks<64>(data, size, nonBlank);
+        break;
+
+    case 32:
+        // PLOADER_EEPROM_BLOCK_SIZE.
+        scanBlocks<32>(data, size, nonBlank);
+        break;
+
+    default:
+        for (size_t offset = 0; offset < fullBlocksSize; offset += blockSize)
+        {
+            nonBlank[offset / blockSize] = !memoryIsBlank(data + offset, blockSize);
+        }
+        break;
+    }
+
+    if (fullBlocksSize < size)
+    {
+        nonBlank.back() = !memoryIsBlank(data + fullBlocksSize,
+            size - fullBlocksSize);
+    }
+
+    return nonBlank;
+}
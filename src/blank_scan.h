@@ -0,0 +1,20 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/* Functions for finding the parts of a memory image that are blank, meaning
+ * every byte is 0xFF, like erased flash.  They use SIMD instructions when the
+ * compiler supports them, and are specialized at compile time for the block
+ * sizes our bootloaders use. */
+
+/** Returns true if every byte is 0xFF. */
+bool memoryIsBlank(const uint8_t * data, size_t size);
+
+/** Scans the whole image in one pass and returns one bit for each block of
+ * blockSize bytes, which is true if the block is not blank.  If the size is
+ * not a multiple of blockSize, the last bit is for the partial block at the
+ * end. */
+std::vector<bool> findNonBlankBlocks(const uint8_t * data, size_t size,
+    uint32_t blockSize);
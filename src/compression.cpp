@@ -0,0 +1,667 @@
+#include "compression.h"
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cassert>
+
+#ifdef PLOAD_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef PLOAD_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// The size of the chunks passed between the pipeline thread and the stream,
+// and the number of chunks that can be waiting.
+#define COMPRESSION_CHUNK_SIZE 0x10000
+#define COMPRESSION_QUEUE_LENGTH 4
+
+CompressionFormat compressionFromMagic(const uint8_t * data, size_t size)
+{
+    static const uint8_t gzipMagic[] = { 0x1F, 0x8B };
+    static const uint8_t zstdMagic[] = { 0x28, 0xB5, 0x2F, 0xFD };
+
+    if (size == 0) { return COMPRESSION_NONE; }
+    if (memcmp(data, gzipMagic, std::min(size, sizeof(gzipMagic))) == 0)
+    {
+        return COMPRESSION_GZIP;
+    }
+    if (memcmp(data, zstdMagic, std::min(size, sizeof(zstdMagic))) == 0)
+    {
+        return COMPRESSION_ZSTD;
+    }
+    return COMPRESSION_NONE;
+}
+
+static bool endsWith(const std::string & str, const std::string & suffix)
+{
+    return str.size() >= suffix.size() &&
+        str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+CompressionFormat compressionFromFileName(const std::string & fileName)
+{
+    if (endsWith(fileName, ".gz")) { return COMPRESSION_GZIP; }
+    if (endsWith(fileName, ".zst")) { return COMPRESSION_ZSTD; }
+    return COMPRESSION_NONE;
+}
+
+namespace
+{
+    /* A Codec compresses or decompresses a stream of data that is given to
+     * it in pieces. */
+    class Codec
+    {
+    public:
+        virtual ~Codec() { }
+
+        // Processes some input and appends the output to a buffer.
+        virtual void update(const char * data, size_t size,
+            std::vector<char> & output) = 0;
+
+        // Appends any remaining output after the last input.  Throws an
+        // exception if the compressed input ended too soon.
+        virtual void finish(std::vector<char> & output) = 0;
+    };
+
+#if defined(PLOAD_HAVE_ZLIB) || defined(PLOAD_HAVE_ZSTD)
+    // Makes room for more output at the end of a buffer, and returns where it
+    // starts.
+    char * growOutput(std::vector<char> & output, size_t & oldSize)
+    {
+        oldSize = output.size();
+        output.resize(oldSize + COMPRESSION_CHUNK_SIZE);
+        return &output[oldSize];
+    }
+#endif
+
+#ifdef PLOAD_HAVE_ZLIB
+    class GzipDecoder : public Codec
+    {
+    public:
+        GzipDecoder() : ended(false)
+        {
+            memset(&stream, 0, sizeof(stream));
+            // Adding 16 to the window bits means we expect a gzip header.
+            if (inflateInit2(&stream, 15 + 16) != Z_OK)
+            {
+                throw std::runtime_error("Failed to start gzip decompression.");
+            }
+        }
+
+        ~GzipDecoder()
+        {
+            inflateEnd(&stream);
+        }
+
+        void update(const char * data, size_t size,
+            std::vector<char> & output) override
+        {
+            stream.next_in = (Bytef *)data;
+            stream.avail_in = size;
+            do
+            {
+                if (ended)
+                {
+                    // A gzip file can have several members one after another.
+                    if (stream.avail_in == 0) { break; }
+                    inflateReset(&stream);
+                    ended = false;
+                }
+
+                size_t oldSize;
+                stream.next_out = (Bytef *)growOutput(output, oldSize);
+                stream.avail_out = COMPRESSION_CHUNK_SIZE;
+                int result = inflate(&stream, Z_NO_FLUSH);
+                output.resize(oldSize + COMPRESSION_CHUNK_SIZE - stream.avail_out);
+
+                if (result == Z_STREAM_END)
+                {
+                    ended = true;
+                }
+                else if (result == Z_BUF_ERROR)
+                {
+                    break;  // Needs more input.
+                }
+                else if (result != Z_OK)
+                {
+                    throw std::runtime_error("Invalid gzip data.");
+                }
+            } while (stream.avail_in > 0 || stream.avail_out == 0);
+        }
+
+        void finish(std::vector<char> &) override
+        {
+            if (!ended)
+            {
+                throw std::runtime_error("The gzip data ends too soon.");
+            }
+        }
+
+    private:
+        z_stream stream;
+        bool ended;
+    };
+
+    class GzipEncoder : public Codec
+    {
+    public:
+        GzipEncoder()
+        {
+            memset(&stream, 0, sizeof(stream));
+            if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            {
+                throw std::runtime_error("Failed to start gzip compression.");
+            }
+        }
+
+        ~GzipEncoder()
+        {
+            deflateEnd(&stream);
+        }
+
+        void update(const char * data, size_t size,
+            std::vector<char> & output) override
+        {
+            stream.next_in = (Bytef *)data;
+            stream.avail_in = size;
+            run(Z_NO_FLUSH, output);
+        }
+
+        void finish(std::vector<char> & output) override
+        {
+            stream.next_in = NULL;
+            stream.avail_in = 0;
+            run(Z_FINISH, output);
+        }
+
+    private:
+        void run(int flush, std::vector<char> & output)
+        {
+            int result;
+            do
+            {
+                size_t oldSize;
+                stream.next_out = (Bytef *)growOutput(output, oldSize);
+                stream.avail_out = COMPRESSION_CHUNK_SIZE;
+                result = deflate(&stream, flush);
+                output.resize(oldSize + COMPRESSION_CHUNK_SIZE - stream.avail_out);
+                if (result == Z_STREAM_ERROR)
+                {
+                    throw std::runtime_error("gzip compression failed.");
+                }
+            } while (stream.avail_in > 0 || stream.avail_out == 0 ||
+                (flush == Z_FINISH && result != Z_STREAM_END));
+        }
+
+        z_stream stream;
+    };
+#endif
+
+#ifdef PLOAD_HAVE_ZSTD
+    class ZstdDecoder : public Codec
+    {
+    public:
+        ZstdDecoder() : remaining(0)
+        {
+            context = ZSTD_createDCtx();
+            if (context == NULL)
+            {
+                throw std::runtime_error("Failed to start zstd decompression.");
+            }
+        }
+
+        ~ZstdDecoder()
+        {
+            ZSTD_freeDCtx(context);
+        }
+
+        void update(const char * data, size_t size,
+            std::vector<char> & output) override
+        {
+            ZSTD_inBuffer in = { data, size, 0 };
+            ZSTD_outBuffer out;
+            do
+            {
+                size_t oldSize;
+                out.dst = growOutput(output, oldSize);
+                out.size = COMPRESSION_CHUNK_SIZE;
+                out.pos = 0;
+                remaining = ZSTD_decompressStream(context, &out, &in);
+                if (ZSTD_isError(remaining))
+                {
+                    throw std::runtime_error(std::string("Invalid zstd data: ") +
+                        ZSTD_getErrorName(remaining) + ".");
+                }
+                output.resize(oldSize + out.pos);
+            } while (in.pos < in.size || out.pos == out.size);
+        }
+
+        void finish(std::vector<char> &) override
+        {
+            // ZSTD_decompressStream returns 0 when it has finished a frame.
+            if (remaining != 0)
+            {
+                throw std::runtime_error("The zstd data ends too soon.");
+            }
+        }
+
+    private:
+        ZSTD_DCtx * context;
+        size_t remaining;
+    };
+
+    class ZstdEncoder : public Codec
+    {
+    public:
+        ZstdEncoder()
+        {
+            context = ZSTD_createCCtx();
+            if (context == NULL)
+            {
+                throw std::runtime_error("Failed to start zstd compression.");
+            }
+        }
+
+        ~ZstdEncoder()
+        {
+            ZSTD_freeCCtx(context);
+        }
+
+        void update(const char * data, size_t size,
+            std::vector<char> & output) override
+        {
+            run(data, size, ZSTD_e_continue, output);
+        }
+
+        void finish(std::vector<char> & output) override
+        {
+            run(NULL, 0, ZSTD_e_end, output);
+        }
+
+    private:
+        void run(const char * data, size_t size, ZSTD_EndDirective directive,
+            std::vector<char> & output)
+        {
+            ZSTD_inBuffer in = { data, size, 0 };
+            size_t left;
+            do
+            {
+                size_t oldSize;
+                ZSTD_outBuffer out = { growOutput(output, oldSize),
+                    COMPRESSION_CHUNK_SIZE, 0 };
+                left = ZSTD_compressStream2(context, &out, &in, directive);
+                if (ZSTD_isError(left))
+                {
+                    throw std::runtime_error(std::string("zstd compression failed: ") +
+                        ZSTD_getErrorName(left) + ".");
+                }
+                output.resize(oldSize + out.pos);
+            } while (in.pos < in.size || (directive == ZSTD_e_end && left != 0));
+        }
+
+        ZSTD_CCtx * context;
+    };
+#endif
+
+    std::unique_ptr<Codec> createCodec(CompressionFormat format, bool compress,
+        const std::string & fileName)
+    {
+        (void)compress;
+        (void)fileName;
+
+        switch (format)
+        {
+        case COMPRESSION_GZIP:
+#ifdef PLOAD_HAVE_ZLIB
+            if (compress) { return std::unique_ptr<Codec>(new GzipEncoder()); }
+            return std::unique_ptr<Codec>(new GzipDecoder());
+#else
+            throw std::runtime_error(fileName +
+                ": This version of p-load was built without gzip support.");
+#endif
+
+        case COMPRESSION_ZSTD:
+#ifdef PLOAD_HAVE_ZSTD
+            if (compress) { return std::unique_ptr<Codec>(new ZstdEncoder()); }
+            return std::unique_ptr<Codec>(new ZstdDecoder());
+#else
+            throw std::runtime_error(fileName +
+                ": This version of p-load was built without zstd support.");
+#endif
+
+        default:
+            break;
+        }
+        assert(0);
+        throw std::runtime_error("Invalid compression format.");
+    }
+
+    /* A ChunkQueue passes chunks of data from one thread to another.  It
+     * holds a limited number of chunks, so a fast producer waits for the
+     * consumer instead of using a lot of memory.  Either side can cancel,
+     * with an error message, to make the other side stop. */
+    class ChunkQueue
+    {
+    public:
+        ChunkQueue() : closed(false), cancelled(false) { }
+
+        // Adds a chunk, waiting while the queue is full.  Returns false if the
+        // queue was cancelled.
+        bool push(std::vector<char> chunk)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&]() {
+                return cancelled || chunks.size() < COMPRESSION_QUEUE_LENGTH;
+            });
+            if (cancelled) { return false; }
+            chunks.push_back(std::move(chunk));
+            changed.notify_all();
+            return true;
+        }
+
+        // Takes the next chunk, waiting for one.  Returns false if there are
+        // no more chunks because the queue was closed or cancelled.
+        bool pop(std::vector<char> & chunk)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&]() {
+                return cancelled || closed || !chunks.empty();
+            });
+            if (cancelled || chunks.empty()) { return false; }
+            chunk = std::move(chunks.front());
+            chunks.pop_front();
+            changed.notify_all();
+            return true;
+        }
+
+        // Says that no more chunks will be pushed.
+        void close()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+            changed.notify_all();
+        }
+
+        void cancel(const std::string & message)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            cancelled = true;
+            if (errorMessage.empty()) { errorMessage = message; }
+            changed.notify_all();
+        }
+
+        std::string error()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return errorMessage;
+        }
+
+    private:
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::deque<std::vector<char>> chunks;
+        bool closed;
+        bool cancelled;
+        std::string errorMessage;
+    };
+
+    /* Reads compressed data from a source stream and decompresses it on a
+     * pipeline thread, and gives the result to the stream that uses this. */
+    class DecompressingBuffer : public std::streambuf
+    {
+    public:
+        DecompressingBuffer(std::shared_ptr<std::istream> source,
+            std::unique_ptr<Codec> codec, const std::string & fileName)
+            : source(source), codec(std::move(codec)), fileName(fileName)
+        {
+            thread = std::thread([this]() { run(); });
+        }
+
+        ~DecompressingBuffer()
+        {
+            queue.cancel("");
+            thread.join();
+        }
+
+    protected:
+        int_type underflow() override
+        {
+            if (gptr() < egptr()) { return traits_type::to_int_type(*gptr()); }
+
+            if (!queue.pop(chunk))
+            {
+                std::string error = queue.error();
+                if (!error.empty()) { throw std::runtime_error(error); }
+                return traits_type::eof();
+            }
+
+            setg(&chunk[0], &chunk[0], &chunk[0] + chunk.size());
+            return traits_type::to_int_type(*gptr());
+        }
+
+    private:
+        void run()
+        {
+            try
+            {
+                std::vector<char> input(COMPRESSION_CHUNK_SIZE);
+                while (true)
+                {
+                    source->read(&input[0], input.size());
+                    size_t size = source->gcount();
+                    if (size == 0) { break; }
+
+                    std::vector<char> output;
+                    codec->update(&input[0], size, output);
+                    if (!output.empty() && !queue.push(std::move(output))) { return; }
+                }
+
+                if (source->bad())
+                {
+                    throw std::runtime_error("Failed to read file.");
+                }
+
+                std::vector<char> output;
+                codec->finish(output);
+                if (!output.empty() && !queue.push(std::move(output))) { return; }
+                queue.close();
+            }
+            catch (const std::exception & error)
+            {
+                queue.cancel(fileName + ": " + error.what());
+            }
+        }
+
+        std::shared_ptr<std::istream> source;
+        std::unique_ptr<Codec> codec;
+        std::string fileName;
+        ChunkQueue queue;
+        std::vector<char> chunk;
+        std::thread thread;
+    };
+
+    class DecompressingStream : public std::istream
+    {
+    public:
+        DecompressingStream(std::shared_ptr<std::istream> source,
+            std::unique_ptr<Codec> codec, const std::string & fileName)
+            : std::istream(NULL), buffer(source, std::move(codec), fileName)
+        {
+            rdbuf(&buffer);
+
+            // Let the errors from the buffer reach the code reading the
+            // stream, instead of just setting badbit.
+            exceptions(std::ios::badbit);
+        }
+
+    private:
+        DecompressingBuffer buffer;
+    };
+
+    /* Collects data written to the stream that uses this, and compresses it
+     * and writes it to a sink stream on a pipeline thread. */
+    class CompressingBuffer : public std::streambuf
+    {
+    public:
+        CompressingBuffer(std::shared_ptr<std::ostream> sink,
+            std::unique_ptr<Codec> codec, const std::string & fileName)
+            : sink(sink), codec(std::move(codec)), fileName(fileName),
+              finished(false)
+        {
+            startChunk();
+            thread = std::thread([this]() { run(); });
+        }
+
+        ~CompressingBuffer()
+        {
+            try
+            {
+                finish();
+            }
+            catch (const std::exception &)
+            {
+                // Destructors cannot throw.  Call finish() to get errors.
+            }
+        }
+
+        void finish()
+        {
+            if (!finished)
+            {
+                finished = true;
+                sendChunk();
+                queue.close();
+                thread.join();
+            }
+
+            std::string error = queue.error();
+            if (!error.empty()) { throw std::runtime_error(error); }
+        }
+
+    protected:
+        int_type overflow(int_type c) override
+        {
+            if (!sendChunk()) { return traits_type::eof(); }
+            startChunk();
+            if (!traits_type::eq_int_type(c, traits_type::eof()))
+            {
+                *pptr() = traits_type::to_char_type(c);
+                pbump(1);
+            }
+            return traits_type::not_eof(c);
+        }
+
+        int sync() override
+        {
+            // Flushing after every line, like std::endl does, would make tiny
+            // chunks, so data is only passed on when a chunk is full or the
+            // stream is finished.
+            return 0;
+        }
+
+    private:
+        void startChunk()
+        {
+            chunk.resize(COMPRESSION_CHUNK_SIZE);
+            setp(&chunk[0], &chunk[0] + chunk.size());
+        }
+
+        // Passes the data written so far to the pipeline thread.
+        bool sendChunk()
+        {
+            chunk.resize(pptr() - pbase());
+            setp(NULL, NULL);
+            if (chunk.empty()) { return true; }
+            return queue.push(std::move(chunk));
+        }
+
+        void run()
+        {
+            try
+            {
+                std::vector<char> input;
+                std::vector<char> output;
+                while (queue.pop(input))
+                {
+                    output.clear();
+                    codec->update(&input[0], input.size(), output);
+                    sink->write(output.data(), output.size());
+                }
+
+                output.clear();
+                codec->finish(output);
+                sink->write(output.data(), output.size());
+                sink->flush();
+                if (!*sink)
+                {
+                    throw std::runtime_error("Failed to write file.");
+                }
+            }
+            catch (const std::exception & error)
+            {
+                queue.cancel(fileName + ": " + error.what());
+            }
+        }
+
+        std::shared_ptr<std::ostream> sink;
+        std::unique_ptr<Codec> codec;
+        std::string fileName;
+        bool finished;
+        ChunkQueue queue;
+        std::vector<char> chunk;
+        std::thread thread;
+    };
+
+    class CompressingStream : public std::ostream
+    {
+    public:
+        CompressingStream(std::shared_ptr<std::ostream> sink,
+            std::unique_ptr<Codec> codec, const std::string & fileName)
+            : std::ostream(NULL), buffer(sink, std::move(codec), fileName)
+        {
+            rdbuf(&buffer);
+        }
+
+        void finish()
+        {
+            buffer.finish();
+        }
+
+    private:
+        CompressingBuffer buffer;
+    };
+}
+
+std::shared_ptr<std::istream> openDecompressingInput(
+    std::shared_ptr<std::istream> source, CompressionFormat format,
+    const std::string & fileName)
+{
+    std::unique_ptr<Codec> codec = createCodec(format, false, fileName);
+    return std::make_shared<DecompressingStream>(source, std::move(codec), fileName);
+}
+
+std::shared_ptr<std::ostream> openCompressingOutput(
+    std::shared_ptr<std::ostream> sink, CompressionFormat format,
+    const std::string & fileName)
+{
+    std::unique_ptr<Codec> codec = createCodec(format, true, fileName);
+    return std::make_shared<CompressingStream>(sink, std::move(codec), fileName);
+}
+
+void finishCompressingOutput(std::ostream & stream)
+{
+    CompressingStream * compressing = dynamic_cast<CompressingStream *>(&stream);
+    if (compressing)
+    {
+        stream.flush();
+        compressing->finish();
+    }
+}
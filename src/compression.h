@@ -0,0 +1,46 @@
+#pragma once
+
+#include <memory>
+#include <iostream>
+#include <string>
+#include <cstdint>
+
+/* Support for reading and writing compressed files as streams.  The data is
+ * decompressed or compressed on a separate pipeline thread, so the codec runs
+ * at the same time as the code that parses or formats the data.
+ *
+ * gzip support uses zlib and zstd support uses libzstd.  Each one is only
+ * available if p-load was built with that library (PLOAD_HAVE_ZLIB and
+ * PLOAD_HAVE_ZSTD); using an unavailable format is an error. */
+
+enum CompressionFormat
+{
+    COMPRESSION_NONE,
+    COMPRESSION_GZIP,
+    COMPRESSION_ZSTD,
+};
+
+/** Detects a compressed format from the first bytes of a file.  If fewer
+ * than 4 bytes are available, only those are checked. */
+CompressionFormat compressionFromMagic(const uint8_t * data, size_t size);
+
+/** Chooses a compressed format from the extension of a file name: ".gz" or
+ * ".zst". */
+CompressionFormat compressionFromFileName(const std::string & fileName);
+
+/** Returns a stream that reads the decompressed contents of source.  Invalid
+ * compressed data causes the read functions to throw std::runtime_error. */
+std::shared_ptr<std::istream> openDecompressingInput(
+    std::shared_ptr<std::istream> source, CompressionFormat,
+    const std::string & fileName);
+
+/** Returns a stream that compresses the data written to it and writes it to
+ * sink.  Call finishCompressingOutput when done writing. */
+std::shared_ptr<std::ostream> openCompressingOutput(
+    std::shared_ptr<std::ostream> sink, CompressionFormat,
+    const std::string & fileName);
+
+/** Finishes the compressed data and waits for it to be written, if the
+ * stream came from openCompressingOutput.  Throws std::runtime_error if the
+ * compression or the writing failed. */
+void finishCompressingOutput(std::ostream &);
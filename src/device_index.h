@@ -0,0 +1,228 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <libusbp.hpp>
+
+/* A DeviceIndex holds the apps or the bootloaders that are connected to the
+ * computer, along with hash indices that let DeviceSelector find devices by
+ * serial number, USB port path, or type without scanning the whole list.
+ *
+ * The index is updated incrementally from each new enumeration of USB
+ * devices.  Devices that were present in the previous enumeration are kept as
+ * they are, so we only open an interface for devices that are new.  A device
+ * is identified by its OS ID, its USB IDs, and its serial number, so a device
+ * that re-enumerates as a bootloader on the same port, or a different unit of
+ * the same product plugged into the same port, is treated as a new device.
+ * This matters on Linux, where the OS ID is just the port.  Reading the
+ * serial number does not open the device, so checking it is cheap.
+ *
+ * Instance must be PloaderAppInstance or PloaderInstance. */
+template <typename Instance> class DeviceIndex
+{
+public:
+    typedef Instance (*Factory)(const libusbp::device &);
+
+    DeviceIndex() : generation(0), nextSequence(0)
+    {
+    }
+
+    /* Brings the index up to date with the specified list of connected USB
+     * devices.  The factory is called for each device that is new, and should
+     * return a null instance if the device is not relevant or not ready. */
+    void update(const std::vector<libusbp::device> & devices, Factory factory)
+    {
+        generation++;
+
+        for (const libusbp::device & device : devices)
+        {
+            std::string osId = device.get_os_id();
+
+            auto it = entries.find(osId);
+            if (it != entries.end())
+            {
+                const Instance & old = it->second.instance;
+                if (old.type->usbVendorId == device.get_vendor_id() &&
+                    old.type->usbProductId == device.get_product_id() &&
+                    serialNumberMatches(device, old.serialNumber))
+                {
+                    it->second.generation = generation;
+                    continue;
+                }
+
+                // Something different is on this port now.
+                unindex(it->second);
+                entries.erase(it);
+            }
+
+            Instance instance = factory(device);
+            if (!instance) { continue; }
+
+            Entry & entry = entries[osId];
+            entry.instance = std::move(instance);
+            entry.generation = generation;
+            entry.sequence = nextSequence++;
+            index(entry);
+        }
+
+        // Remove the devices that are no longer connected.
+        for (auto it = entries.begin(); it != entries.end(); )
+        {
+            if (it->second.generation != generation)
+            {
+                unindex(it->second);
+                it = entries.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    /* Returns pointers to the devices that satisfy all of the specified
+     * conditions, in the order they were first seen.  A null pointer for one
+     * of the arguments means that condition is not used.  The pointers remain
+     * valid until the next call to update(). */
+    template <typename Type>
+    std::vector<const Instance *> find(
+        const std::string * serialNumber,
+        const std::string * portPath,
+        const std::vector<const Type *> * types) const
+    {
+        std::vector<const Entry *> found;
+
+        auto matches = [&](const Entry & entry) -> bool
+        {
+            const Instance & i = entry.instance;
+            if (serialNumber && i.serialNumber != *serialNumber) { return false; }
+            if (portPath && i.portPath != *portPath) { return false; }
+            if (types && std::find(types->begin(), types->end(), i.type) == types->end())
+            {
+                return false;
+            }
+            return true;
+        };
+
+        // Use the most selective index we can.
+        if (serialNumber)
+        {
+            auto range = bySerialNumber.equal_range(*serialNumber);
+            for (auto it = range.first; it != range.second; ++it)
+            {
+                if (matches(*it->second)) { found.push_back(it->second); }
+            }
+        }
+        else if (portPath)
+        {
+            auto range = byPortPath.equal_range(*portPath);
+            for (auto it = range.first; it != range.second; ++it)
+            {
+                if (matches(*it->second)) { found.push_back(it->second); }
+            }
+        }
+        else if (types)
+        {
+            for (const Type * type : *types)
+            {
+                auto range = byTypeId.equal_range(type->id);
+                for (auto it = range.first; it != range.second; ++it)
+                {
+                    if (matches(*it->second)) { found.push_back(it->second); }
+                }
+            }
+        }
+        else
+        {
+            for (const auto & pair : entries)
+            {
+                found.push_back(&pair.second);
+            }
+        }
+
+        // Sort the results and remove duplicates that can happen if the same
+        // type was specified twice.
+        std::sort(found.begin(), found.end(),
+            [](const Entry * a, const Entry * b) { return a->sequence < b->sequence; });
+        found.erase(std::unique(found.begin(), found.end()), found.end());
+
+        std::vector<const Instance *> r;
+        r.reserve(found.size());
+        for (const Entry * entry : found)
+        {
+            r.push_back(&entry->instance);
+        }
+        return r;
+    }
+
+    size_t size() const
+    {
+        return entries.size();
+    }
+
+private:
+    static bool serialNumberMatches(const libusbp::device & device,
+        const std::string & serialNumber)
+    {
+        try
+        {
+            return device.get_serial_number() == serialNumber;
+        }
+        catch (const libusbp::error &)
+        {
+            // The factory would have failed the same way, so the device is
+            // not the one we have.
+            return false;
+        }
+    }
+
+    struct Entry
+    {
+        Instance instance;
+        uint32_t generation;
+        uint64_t sequence;
+    };
+
+    typedef std::unordered_multimap<std::string, const Entry *> StringIndex;
+
+    void index(const Entry & entry)
+    {
+        bySerialNumber.emplace(entry.instance.serialNumber, &entry);
+        byPortPath.emplace(entry.instance.portPath, &entry);
+        byTypeId.emplace(entry.instance.type->id, &entry);
+    }
+
+    template <typename Map, typename Key>
+    static void unindexOne(Map & map, const Key & key, const Entry * entry)
+    {
+        auto range = map.equal_range(key);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            if (it->second == entry)
+            {
+                map.erase(it);
+                return;
+            }
+        }
+    }
+
+    void unindex(const Entry & entry)
+    {
+        unindexOne(bySerialNumber, entry.instance.serialNumber, &entry);
+        unindexOne(byPortPath, entry.instance.portPath, &entry);
+        unindexOne(byTypeId, entry.instance.type->id, &entry);
+    }
+
+    // The devices, keyed by OS ID.  Elements of an unordered_map do not move
+    // in memory, so the other indices can point to them.
+    std::unordered_map<std::string, Entry> entries;
+
+    StringIndex bySerialNumber;
+    StringIndex byPortPath;
+    std::unordered_multimap<uint32_t, const Entry *> byTypeId;
+
+    uint32_t generation;
+    uint64_t nextSequence;
+};
@@ -0,0 +1,199 @@
+#include "device_lock.h"
+#include <stdexcept>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <cstdint>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#endif
+
+// Returns the name of the lock file to use for the specified key.  Characters
+// that might not be allowed in file names are escaped as %XX, so different
+// keys always get different files.
+static std::string lockFileName(const std::string & key)
+{
+    std::string dir;
+#ifdef _WIN32
+    char buffer[MAX_PATH + 1];
+    DWORD length = GetTempPathA(sizeof(buffer), buffer);
+    if (length > 0 && length < sizeof(buffer))
+    {
+        dir = std::string(buffer, length);
+    }
+#else
+    const char * tmpdir = getenv("TMPDIR");
+    dir = std::string(tmpdir && tmpdir[0] ? tmpdir : "/tmp") + "/";
+#endif
+
+    std::string name = "p-load-";
+    for (char c : key)
+    {
+        bool safe = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+            (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_';
+        if (safe)
+        {
+            name += c;
+        }
+        else
+        {
+            const char * hex = "0123456789ABCDEF";
+            name += '%';
+            name += hex[(uint8_t)c >> 4];
+            name += hex[(uint8_t)c & 0xF];
+        }
+    }
+    name += ".lock";
+
+    return dir + name;
+}
+
+#ifndef _WIN32
+// Opens the lock file, creating it if needed.  The temporary directory is
+// shared with other users, so we do not follow symbolic links, we only accept
+// regular files, and we use O_NONBLOCK so a FIFO planted there cannot block
+// us.  The file is opened read-only because flock() does not need write
+// access, and that lets other users lock a file we created.
+static int openLockFile(const std::string & fileName)
+{
+    int f = -1;
+    for (unsigned int attempt = 0; f < 0 && attempt < 10; attempt++)
+    {
+        f = open(fileName.c_str(), O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+        if (f < 0 && errno == ENOENT)
+        {
+            f = open(fileName.c_str(),
+                O_RDONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC,
+                0644);
+        }
+        if (f < 0 && errno != ENOENT && errno != EEXIST) { break; }
+    }
+    if (f < 0)
+    {
+        int error_code = errno;
+        throw std::runtime_error(fileName + ": " + strerror(error_code) + ".");
+    }
+
+    struct stat info;
+    if (fstat(f, &info) != 0 || !S_ISREG(info.st_mode))
+    {
+        close(f);
+        throw std::runtime_error(fileName + ": Lock file is not a regular file.");
+    }
+
+    return f;
+}
+#endif
+
+DeviceLock::DeviceLock() : held(false)
+{
+#ifdef _WIN32
+    handle = INVALID_HANDLE_VALUE;
+#else
+    fd = -1;
+#endif
+}
+
+DeviceLock::~DeviceLock()
+{
+    unlock();
+}
+
+DeviceLock::DeviceLock(DeviceLock && other) noexcept : DeviceLock()
+{
+    *this = std::move(other);
+}
+
+DeviceLock & DeviceLock::operator=(DeviceLock && other) noexcept
+{
+    if (this != &other)
+    {
+        unlock();
+        held = other.held;
+        other.held = false;
+#ifdef _WIN32
+        handle = other.handle;
+        other.handle = INVALID_HANDLE_VALUE;
+#else
+        fd = other.fd;
+        other.fd = -1;
+#endif
+    }
+    return *this;
+}
+
+bool DeviceLock::tryLock(const std::string & key)
+{
+    return tryLock(key, true);
+}
+
+bool DeviceLock::isHeldElsewhere(const std::string & key)
+{
+    DeviceLock probe;
+    return !probe.tryLock(key, false);
+}
+
+bool DeviceLock::tryLock(const std::string & key, bool exclusive)
+{
+    unlock();
+
+    std::string fileName = lockFileName(key);
+
+#ifdef _WIN32
+    HANDLE h = CreateFileA(fileName.c_str(), GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+        OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h == INVALID_HANDLE_VALUE)
+    {
+        throw std::runtime_error(fileName + ": Failed to open lock file.");
+    }
+
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+    DWORD flags = LOCKFILE_FAIL_IMMEDIATELY;
+    if (exclusive) { flags |= LOCKFILE_EXCLUSIVE_LOCK; }
+    if (!LockFileEx(h, flags, 0, 1, 0, &overlapped))
+    {
+        CloseHandle(h);
+        return false;
+    }
+
+    handle = h;
+#else
+    int f = openLockFile(fileName);
+    if (flock(f, (exclusive ? LOCK_EX : LOCK_SH) | LOCK_NB) != 0)
+    {
+        int error_code = errno;
+        close(f);
+        if (error_code == EWOULDBLOCK) { return false; }
+        throw std::runtime_error(fileName + ": " + strerror(error_code) + ".");
+    }
+
+    fd = f;
+#endif
+
+    held = true;
+    return true;
+}
+
+void DeviceLock::unlock()
+{
+    if (!held) { return; }
+    held = false;
+
+    // We do not delete the lock file because another process might have
+    // opened it and be waiting to lock it.
+#ifdef _WIN32
+    CloseHandle(handle);
+    handle = INVALID_HANDLE_VALUE;
+#else
+    close(fd);
+    fd = -1;
+#endif
+}
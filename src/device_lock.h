@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+
+/* A DeviceLock is an advisory lock on one device that is shared by all the
+ * p-load processes running on the computer, so that two processes never
+ * operate on the same device at the same time.
+ *
+ * Each lock is a file in the temporary directory whose name is derived from a
+ * key, such as the serial number or the USB port path of the device.  The file
+ * is locked with flock() on Linux and macOS or LockFileEx() on Windows, so the
+ * operating system releases the lock if the process exits for any reason. */
+class DeviceLock
+{
+public:
+    DeviceLock();
+    ~DeviceLock();
+
+    DeviceLock(DeviceLock &&) noexcept;
+    DeviceLock & operator=(DeviceLock &&) noexcept;
+
+    DeviceLock(const DeviceLock &) = delete;
+    DeviceLock & operator=(const DeviceLock &) = delete;
+
+    /* Tries to take the lock with the specified key without waiting.  Returns
+     * false if another process holds it.  Throws an exception if the lock
+     * file cannot be opened. */
+    bool tryLock(const std::string & key);
+
+    /* Returns true if another process holds the lock with the specified key.
+     * This takes a shared lock for a moment instead of an exclusive one, so
+     * processes checking the same lock do not get in each other's way. */
+    static bool isHeldElsewhere(const std::string & key);
+
+    /* Releases the lock, if it is held. */
+    void unlock();
+
+    operator bool() const noexcept
+    {
+        return held;
+    }
+
+private:
+    bool tryLock(const std::string & key, bool exclusive);
+
+    bool held;
+
+#ifdef _WIN32
+    void * handle;
+#else
+    int fd;
+#endif
+};
@@ -1,12 +1,45 @@
 #include "p-load.h"
 #include "device_selector.h"
+#include <algorithm>
+#include <mutex>
+#include <chrono>
+#include <thread>
+
+typedef std::chrono::steady_clock Clock;
+
+// The most recent list of connected USB devices.  It is shared by all the
+// DeviceSelector objects in the process so that jobs running at the same time
+// do not each enumerate the devices.
+static std::mutex sharedListMutex;
+static std::vector<libusbp::device> sharedList;
+static Clock::time_point sharedListTime;
+static bool sharedListValid = false;
+
+// Returns a list of the connected USB devices that was made after the
+// specified time.
+static std::vector<libusbp::device> listConnectedDevicesSince(Clock::time_point time)
+{
+    std::lock_guard<std::mutex> lock(sharedListMutex);
+
+    if (!sharedListValid || sharedListTime < time)
+    {
+        sharedListTime = Clock::now();
+        sharedList = libusbp::list_connected_devices();
+        sharedListValid = true;
+    }
+    return sharedList;
+}
 
 DeviceSelector::DeviceSelector()
 {
+    appSelected = false;
     serialNumberSpecified = false;
+    portPathSpecified = false;
     typesSpecified = false;
     firmwareDataSpecified = false;
     userTypeSpecified = false;
+    devicesListed = false;
+    devicesClearedTime = Clock::now();
     appListInitialized = false;
     bootloaderListInitialized = false;
 }
@@ -23,6 +56,18 @@ void DeviceSelector::specifySerialNumber(const std::string & str)
     serialNumberSpecified = true;
 }
 
+void DeviceSelector::specifyPortPath(const std::string & str)
+{
+    assert(!portPathSpecified);
+    assert(!appListInitialized);
+    assert(!appSelected && !app);
+    assert(!bootloaderListInitialized);
+    assert(!bootloader);
+
+    portPath = str;
+    portPathSpecified = true;
+}
+
 void DeviceSelector::specifyFirmwareData(const FirmwareData & data)
 {
     assert(!appListInitialized);
@@ -52,9 +97,9 @@ void DeviceSelector::specifyFirmwareData(const FirmwareData & data)
             const PloaderType * type = ploaderTypeLookup(usbVendorId, usbProductId);
             if (type == NULL) { continue; }
 
-            bootloaderTypes.push_back(*type);
+            bootloaderTypes.push_back(type);
 
-            for (const PloaderAppType & appType : type->getMatchingAppTypes())
+            for (const PloaderAppType * appType : type->getMatchingAppTypes())
             {
                 appTypes.push_back(appType);
             }
@@ -82,12 +127,12 @@ void DeviceSelector::specifyUserType(const PloaderUserType & userType)
     // high-level type than its bootloader; the user could specify the
     // "-t" option twice to support that case.
 
-    for (const PloaderAppType & appType : userType.getMatchingAppTypes())
+    for (const PloaderAppType * appType : userType.getMatchingAppTypes())
     {
         appTypes.push_back(appType);
     }
 
-    for (const PloaderType & type : userType.getMatchingTypes())
+    for (const PloaderType * type : userType.getMatchingTypes())
     {
         bootloaderTypes.push_back(type);
     }
@@ -101,97 +146,254 @@ bool DeviceSelector::serialNumberWasSpecified() const
     return serialNumberSpecified;
 }
 
+bool DeviceSelector::portPathWasSpecified() const
+{
+    return portPathSpecified;
+}
+
 void DeviceSelector::clearDeviceLists()
 {
     assert(!bootloader);
+    devicesListed = false;
+    devicesClearedTime = Clock::now();
     appListInitialized = false;
     appList.clear();
     bootloaderListInitialized = false;
     bootloaderList.clear();
 }
 
-template<typename T>
-static std::vector<T> filterBySerialNumber(
-    const std::vector<T> & in, std::string serialNumber)
+// Enumerates the USB devices once and updates both device indices, unless
+// that was already done since the last call to clearDeviceLists().
+void DeviceSelector::updateDeviceIndices()
 {
-    std::vector<T> out;
-    for (const T & item : in)
+    if (devicesListed) { return; }
+    devicesListed = true;
+
+    // Any enumeration that started after our lists were cleared is recent
+    // enough.
+    std::vector<libusbp::device> devices =
+        listConnectedDevicesSince(devicesClearedTime);
+
+    if (portPathSpecified)
+    {
+        // Drop the devices on other ports before the indices see them, so we
+        // never read serial numbers or open interfaces for those devices.
+        // An app that restarts into its bootloader stays on the same port, so
+        // this also finds the bootloader after we launch it.
+        devices.erase(std::remove_if(devices.begin(), devices.end(),
+            [&](const libusbp::device & device) {
+                return ploaderGetPortPath(device) != portPath;
+            }),
+            devices.end());
+    }
+
+    appIndex.update(devices, ploaderGetApp);
+    bootloaderIndex.update(devices, ploaderGetBootloader);
+}
+
+const std::vector<const PloaderAppInstance *> & DeviceSelector::listApps()
+{
+    if (!appListInitialized)
     {
-        if (serialNumber == item.serialNumber)
+        updateDeviceIndices();
+        appListInitialized = true;
+        appList = appIndex.find(
+            serialNumberSpecified ? &serialNumber : NULL,
+            portPathSpecified ? &portPath : NULL,
+            typesSpecified ? &appTypes : NULL);
+    }
+    return appList;
+}
+
+const std::vector<const PloaderInstance *> & DeviceSelector::listBootloaders()
+{
+    if (!bootloaderListInitialized)
+    {
+        assert(!bootloader);
+
+        updateDeviceIndices();
+        bootloaderListInitialized = true;
+
+        // If we launched the bootloader of an app, we only want to find the
+        // bootloader for that same device.  If a port was specified, the port
+        // already identifies the device.
+        const std::string * serialNumberFilter = NULL;
+        if (serialNumberSpecified)
+        {
+            serialNumberFilter = &serialNumber;
+        }
+        else if (app && !portPathSpecified)
         {
-            out.push_back(item);
+            serialNumberFilter = &app.serialNumber;
         }
+
+        bootloaderList = bootloaderIndex.find(
+            serialNumberFilter,
+            portPathSpecified ? &portPath : NULL,
+            typesSpecified ? &bootloaderTypes : NULL);
     }
-    return out;
+    return bootloaderList;
 }
 
-template<typename L, typename T>
-static std::vector<L> filterByType(
-    const std::vector<L> & in, const std::vector<T> & types)
+// Returns the keys of the locks that protect a device.  We lock by serial
+// number and by USB port path so that processes selecting the same device in
+// different ways still exclude each other.
+template <typename T>
+static std::vector<std::string> deviceLockKeys(const T & instance)
 {
-    std::vector<L> out;
-    for (const L & item : in)
+    std::vector<std::string> keys;
+    if (!instance.serialNumber.empty())
+    {
+        keys.push_back("serial-" + instance.serialNumber);
+    }
+    if (!instance.portPath.empty())
     {
-        const T & actualType = item.type;
+        keys.push_back("port-" + instance.portPath);
+    }
+    return keys;
+}
 
-        for (const T & type : types)
+template <typename T>
+bool DeviceSelector::isLockedElsewhere(const T & instance)
+{
+    for (const std::string & key : deviceLockKeys(instance))
+    {
+        if (deviceLocks.count(key)) { continue; }
+
+        if (DeviceLock::isHeldElsewhere(key)) { return true; }
+    }
+    return false;
+}
+
+template <typename T>
+std::vector<const T *> DeviceSelector::leaveOutLocked(
+    const std::vector<const T *> & list)
+{
+    std::vector<const T *> r;
+    for (const T * instance : list)
+    {
+        if (!isLockedElsewhere(*instance))
+        {
+            r.push_back(instance);
+        }
+    }
+    return r;
+}
+
+template <typename T>
+void DeviceSelector::lockDevice(const T & instance)
+{
+    // We only keep the locks if we get all of them, so a device is never
+    // left half-locked.
+    std::map<std::string, DeviceLock> newLocks;
+
+    for (const std::string & key : deviceLockKeys(instance))
+    {
+        if (deviceLocks.count(key)) { continue; }
+
+        // Another process checking whether the device is locked holds the
+        // lock for a moment, so try again for a short time before giving up.
+        DeviceLock lock;
+        Clock::time_point deadline = Clock::now() +
+            std::chrono::milliseconds(200);
+        while (!lock.tryLock(key))
         {
-            if (type == actualType)
+            if (Clock::now() > deadline)
             {
-                out.push_back(item);
-                break;
+                // Another process locked the device after we checked it.
+                throw deviceInUseError();
             }
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
         }
+        newLocks[key] = std::move(lock);
+    }
+
+    for (auto & pair : newLocks)
+    {
+        deviceLocks[pair.first] = std::move(pair.second);
     }
-    return out;
 }
 
-std::vector<PloaderAppInstance> DeviceSelector::listApps()
+void DeviceSelector::releaseDeviceLocks()
 {
-    if (!appListInitialized)
-    {
-        appListInitialized = true;
-        appList = ploaderListApps();
+    deviceLocks.clear();
+}
 
-        if (serialNumberSpecified)
+void DeviceSelector::waitForBootloader(uint32_t timeoutSeconds, bool includeLocked)
+{
+    Clock::time_point startTime = Clock::now();
+    while (1)
+    {
+        if (includeLocked ? listBootloaders().size() : listUnlockedBootloaders().size())
         {
-            appList = filterBySerialNumber(appList, serialNumber);
+            return;
         }
 
-        if (typesSpecified)
+        if (Clock::now() - startTime > std::chrono::seconds(timeoutSeconds))
         {
-            appList = filterByType(appList, appTypes);
+            throw deviceNotFoundError();
         }
+
+        // Sleep so that we don't take up 100% CPU time.
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        // The previous lists of devices are stale because we delayed.
+        clearDeviceLists();
     }
-    return appList;
 }
 
-std::vector<PloaderInstance> DeviceSelector::listBootloaders()
+std::vector<const PloaderAppInstance *> DeviceSelector::listUnlockedApps()
 {
-    if (!bootloaderListInitialized)
-    {
-        assert(!bootloader);
+    return leaveOutLocked(listApps());
+}
 
-        bootloaderListInitialized = true;
-        bootloaderList = ploaderListBootloaders();
+std::vector<const PloaderInstance *> DeviceSelector::listUnlockedBootloaders()
+{
+    return leaveOutLocked(listBootloaders());
+}
 
-        if (serialNumberSpecified)
+std::vector<const PloaderType *> DeviceSelector::listPossibleBootloaderTypes()
+{
+    const std::vector<const PloaderAppInstance *> & apps = listApps();
+    const std::vector<const PloaderInstance *> & bootloaders = listBootloaders();
+    bool devicesFound = apps.size() > 0 || bootloaders.size() > 0;
+
+    std::vector<const PloaderType *> types;
+    for (const PloaderType & type : ploaderTypes)
+    {
+        if (typesSpecified && std::find(bootloaderTypes.begin(),
+            bootloaderTypes.end(), &type) == bootloaderTypes.end())
         {
-            bootloaderList = filterBySerialNumber(bootloaderList, serialNumber);
+            continue;
         }
 
-        if (app)
+        if (devicesFound)
         {
-            bootloaderList = filterBySerialNumber(bootloaderList, app.serialNumber);
+            bool used = false;
+            for (const PloaderInstance * bootloader : bootloaders)
+            {
+                if (bootloader->type == &type) { used = true; }
+            }
+            std::vector<const PloaderAppType *> matchingAppTypes =
+                type.getMatchingAppTypes();
+            for (const PloaderAppInstance * app : apps)
+            {
+                if (std::find(matchingAppTypes.begin(), matchingAppTypes.end(),
+                    app->type) != matchingAppTypes.end())
+                {
+                    used = true;
+                }
+            }
+            if (!used) { continue; }
         }
-
-        if (typesSpecified)
+        else if (!typesSpecified)
         {
-            bootloaderList = filterByType(bootloaderList, bootloaderTypes);
+            break;
         }
 
+        types.push_back(&type);
     }
-    return bootloaderList;
+    return types;
 }
 
 PloaderAppInstance DeviceSelector::selectAppToLaunchBootloader()
@@ -203,8 +405,8 @@ PloaderAppInstance DeviceSelector::selectAppToLaunchBootloader()
     assert(!app);
     assert(!bootloader);
 
-    auto appList = listApps();
-    auto bootloaderList = listBootloaders();
+    auto appList = leaveOutLocked(listApps());
+    auto bootloaderList = leaveOutLocked(listBootloaders());
 
     if (bootloaderList.size() + appList.size() > 1)
     {
@@ -214,8 +416,10 @@ PloaderAppInstance DeviceSelector::selectAppToLaunchBootloader()
     if (appList.size() > 0)
     {
         // There is one matching device and it is in app mode, so we will need
-        // to restart it.
-        app = appList[0];
+        // to restart it.  Lock it first so no other process will try to use
+        // the bootloader we are about to start.
+        lockDevice(*appList[0]);
+        app = *appList[0];
     }
     else
     {
@@ -229,11 +433,15 @@ PloaderInstance DeviceSelector::selectBootloader()
 {
     if (bootloader) { return bootloader; }
 
-    auto appList = listApps();
-    auto bootloaderList = listBootloaders();
+    auto appList = leaveOutLocked(listApps());
+    auto bootloaderList = leaveOutLocked(listBootloaders());
 
     if (bootloaderList.size() == 0)
     {
+        if (listBootloaders().size() > 0)
+        {
+            throw deviceInUseError();
+        }
         throw deviceNotFoundError();
     }
 
@@ -242,7 +450,8 @@ PloaderInstance DeviceSelector::selectBootloader()
         throw deviceMultipleFoundError();
     }
 
-    bootloader = bootloaderList[0];
+    lockDevice(*bootloaderList[0]);
+    bootloader = *bootloaderList[0];
     return bootloader;
 }
 
@@ -261,6 +470,11 @@ std::string DeviceSelector::deviceNotFoundMessage() const
             serialNumber + "'";
     }
 
+    if (portPathSpecified)
+    {
+        r += std::string(" on USB port '") + portPath + "'";
+    }
+
     r += ".";
     return r;
 }
@@ -275,6 +489,60 @@ ExceptionWithExitCode DeviceSelector::deviceMultipleFoundError() const
 {
     return ExceptionWithExitCode(PLOAD_ERROR_DEVICE_MULTIPLE_FOUND,
         "There are multiple qualifying devices connected to this computer.\n"
-        "Use the -t or -d options to specify which device you want to use,\n"
+        "Use the -t, -d, or -p options to specify which device you want to use,\n"
         "or disconnect the others.");
 }
+
+ExceptionWithExitCode DeviceSelector::deviceInUseError() const
+{
+    return ExceptionWithExitCode(PLOAD_ERROR_DEVICE_IN_USE,
+        "The device is being used by another p-load process.");
+}
+
+AppWaiter::AppWaiter(const PloaderInstance & bootloader)
+{
+    selector.specifySerialNumber(bootloader.serialNumber);
+    if (!bootloader.portPath.empty())
+    {
+        selector.specifyPortPath(bootloader.portPath);
+    }
+    appTypes = bootloader.type->getMatchingAppTypes();
+}
+
+bool AppWaiter::appIsRunning()
+{
+    selector.clearDeviceLists();
+    for (const PloaderAppInstance * app : selector.listApps())
+    {
+        if (std::find(appTypes.begin(), appTypes.end(), app->type) != appTypes.end())
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+double AppWaiter::wait(uint32_t timeoutSeconds)
+{
+    Clock::time_point startTime = Clock::now();
+    while (!appIsRunning())
+    {
+        if (Clock::now() - startTime > std::chrono::seconds(timeoutSeconds))
+        {
+            throw timeoutError(timeoutSeconds);
+        }
+
+        // libusbp does not tell us when devices are connected, so we check
+        // often to measure the reboot time accurately.
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    return std::chrono::duration<double>(Clock::now() - startTime).count();
+}
+
+ExceptionWithExitCode AppWaiter::timeoutError(uint32_t timeoutSeconds)
+{
+    std::ostringstream message;
+    message << "The app did not start within " << timeoutSeconds
+        << " seconds after restarting the device.";
+    return ExceptionWithExitCode(PLOAD_ERROR_APP_NOT_RUNNING, message.str());
+}
@@ -3,6 +3,10 @@
 #include "ploader.h"
 #include "firmware_data.h"
 #include "exit_codes.h"
+#include "device_index.h"
+#include "device_lock.h"
+#include <map>
+#include <chrono>
 
 /* A DeviceSelector object contains logic for finding bootloaders and apps and
  * selecting the right ones to operate on. */
@@ -12,24 +16,61 @@ public:
     DeviceSelector();
 
     void specifySerialNumber(const std::string &);
+    void specifyPortPath(const std::string &);
     void specifyFirmwareData(const FirmwareData &);
     void specifyUserType(const PloaderUserType &);
 
     void clearDeviceLists();
 
-    std::vector<PloaderAppInstance> listApps();
-    std::vector<PloaderInstance> listBootloaders();
+    /* These return lists of the qualifying devices.  The pointers in them
+     * remain valid until the next call to clearDeviceLists(). */
+    const std::vector<const PloaderAppInstance *> & listApps();
+    const std::vector<const PloaderInstance *> & listBootloaders();
 
+    /* Like listApps and listBootloaders, but leave out devices that another
+     * p-load process has locked. */
+    std::vector<const PloaderAppInstance *> listUnlockedApps();
+    std::vector<const PloaderInstance *> listUnlockedBootloaders();
+
+    /* Returns the types of bootloader we might end up using, without
+     * changing any devices.  If qualifying devices are connected, these are
+     * the types of their bootloaders.  Otherwise, these are the types that
+     * were specified, or an empty list if no types were specified. */
+    std::vector<const PloaderType *> listPossibleBootloaderTypes();
+
+    /* These functions select a device and lock it so that other p-load
+     * processes will not use it.  The locks are held until
+     * releaseDeviceLocks() is called or the process exits. */
     PloaderAppInstance selectAppToLaunchBootloader();
     PloaderInstance selectBootloader();
 
+    void releaseDeviceLocks();
+
+    /* Waits for a qualifying bootloader to appear, checking every 100 ms.
+     * Bootloaders locked by other processes do not count unless
+     * includeLocked is true.  Throws deviceNotFoundError() if none appears
+     * within the timeout. */
+    void waitForBootloader(uint32_t timeoutSeconds, bool includeLocked = false);
+
     bool serialNumberWasSpecified() const;
+    bool portPathWasSpecified() const;
 
     std::string deviceNotFoundMessage() const;
     ExceptionWithExitCode deviceNotFoundError() const;
     ExceptionWithExitCode deviceMultipleFoundError() const;
+    ExceptionWithExitCode deviceInUseError() const;
 
 private:
+    void updateDeviceIndices();
+
+    template <typename T> std::vector<const T *> leaveOutLocked(
+        const std::vector<const T *> &);
+    template <typename T> bool isLockedElsewhere(const T &);
+    template <typename T> void lockDevice(const T &);
+
+    // The device locks we hold, indexed by key.
+    std::map<std::string, DeviceLock> deviceLocks;
+
     bool appSelected;
     PloaderAppInstance app;
 
@@ -38,15 +79,49 @@ private:
     bool serialNumberSpecified;
     std::string serialNumber;
 
+    bool portPathSpecified;
+    std::string portPath;
+
     bool typesSpecified;
     bool userTypeSpecified;
     bool firmwareDataSpecified;
-    std::vector<PloaderAppType> appTypes;
-    std::vector<PloaderType> bootloaderTypes;
+    std::vector<const PloaderAppType *> appTypes;
+    std::vector<const PloaderType *> bootloaderTypes;
+
+    // All of the known apps and bootloaders connected to the computer.
+    bool devicesListed;
+    std::chrono::steady_clock::time_point devicesClearedTime;
+    DeviceIndex<PloaderAppInstance> appIndex;
+    DeviceIndex<PloaderInstance> bootloaderIndex;
 
     bool appListInitialized;
-    std::vector<PloaderAppInstance> appList;
+    std::vector<const PloaderAppInstance *> appList;
 
     bool bootloaderListInitialized;
-    std::vector<PloaderInstance> bootloaderList;
+    std::vector<const PloaderInstance *> bootloaderList;
+};
+
+/* An AppWaiter looks for the app of a bootloader that was just restarted.
+ * The app must have the same serial number as the bootloader, and be on the
+ * same USB port if we know it.  This is used by Session and by all the ways
+ * the p-load executable runs jobs. */
+class AppWaiter
+{
+public:
+    explicit AppWaiter(const PloaderInstance & bootloader);
+
+    /* Checks the connected devices once and returns true if the app is
+     * running. */
+    bool appIsRunning();
+
+    /* Waits for the app to start, checking often so the time is accurate,
+     * and returns the number of seconds that took.  Throws timeoutError()
+     * if it takes too long. */
+    double wait(uint32_t timeoutSeconds);
+
+    static ExceptionWithExitCode timeoutError(uint32_t timeoutSeconds);
+
+private:
+    DeviceSelector selector;
+    std::vector<const PloaderAppType *> appTypes;
 };
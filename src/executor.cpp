@@ -0,0 +1,65 @@
+#include "executor.h"
+#include <thread>
+#include <algorithm>
+
+void Executor::add(std::unique_ptr<Task> task)
+{
+    Entry entry;
+    entry.task = std::move(task);
+    entry.wakeTime = Clock::now();
+    newTasks.push_back(std::move(entry));
+}
+
+bool Executor::stepReadyTask()
+{
+    // Tasks added since the last step go to the back of the line.
+    while (!newTasks.empty())
+    {
+        tasks.push_back(std::move(newTasks.front()));
+        newTasks.pop_front();
+    }
+
+    Clock::time_point now = Clock::now();
+
+    // Run the first task in line that is ready, and then move it to the back
+    // of the line so the tasks take turns.
+    for (auto it = tasks.begin(); it != tasks.end(); ++it)
+    {
+        if (it->wakeTime > now) { continue; }
+
+        Entry entry = std::move(*it);
+        tasks.erase(it);
+
+        entry.wakeTime = now;
+        if (entry.task->step(entry.wakeTime))
+        {
+            tasks.push_back(std::move(entry));
+        }
+        return true;
+    }
+    return false;
+}
+
+void Executor::runUntil(Clock::time_point endTime)
+{
+    while (size() > 0 && Clock::now() < endTime)
+    {
+        if (stepReadyTask()) { continue; }
+
+        // No task is ready, so sleep until one is.
+        Clock::time_point wakeTime = endTime;
+        for (const Entry & entry : tasks)
+        {
+            wakeTime = std::min(wakeTime, entry.wakeTime);
+        }
+        std::this_thread::sleep_until(wakeTime);
+    }
+}
+
+void Executor::run()
+{
+    while (size() > 0)
+    {
+        runUntil(Clock::time_point::max());
+    }
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <memory>
+#include <deque>
+#include <chrono>
+
+/* An Executor runs many tasks on one thread.  Each task is a state machine
+ * whose step() function does a small amount of work, such as one USB request,
+ * and says when it wants to run again.  The executor takes turns between the
+ * tasks that are ready and sleeps when none are, so one thread can keep many
+ * devices busy: while some devices are re-enumerating or rebooting, the others
+ * get all of the USB requests.
+ *
+ * libusbp only does control transfers synchronously, so two requests never
+ * overlap, but for bootloaders most of the time is spent waiting for devices
+ * to appear, and that waiting is what the executor overlaps. */
+class Executor
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    class Task
+    {
+    public:
+        virtual ~Task() { }
+
+        /* Does the next bit of work for this task.  Returns false if the task
+         * is finished.  To wait before the next step, set wakeTime; it is
+         * set to the current time before each call.  Tasks must handle their
+         * own errors. */
+        virtual bool step(Clock::time_point & wakeTime) = 0;
+    };
+
+    /* Adds a task.  This can be called while the executor is running, for
+     * example by a task. */
+    void add(std::unique_ptr<Task> task);
+
+    /* Runs the tasks until they are all finished. */
+    void run();
+
+    /* Runs the tasks until the specified time, or until they are all
+     * finished. */
+    void runUntil(Clock::time_point endTime);
+
+    size_t size() const
+    {
+        return tasks.size() + newTasks.size();
+    }
+
+private:
+    struct Entry
+    {
+        std::unique_ptr<Task> task;
+        Clock::time_point wakeTime;
+    };
+
+    // Returns false if no task was ready.
+    bool stepReadyTask();
+
+    std::deque<Entry> tasks;
+    std::deque<Entry> newTasks;
+};
@@ -2,11 +2,9 @@
 
 #include "p-load.h"
 
-// Process exit codes:
-#define PLOAD_ERROR_BAD_ARGS 1
-#define PLOAD_ERROR_OPERATION_FAILED 2
-#define PLOAD_ERROR_DEVICE_NOT_FOUND 3
-#define PLOAD_ERROR_DEVICE_MULTIPLE_FOUND 4
+// The process exit codes are defined in libpload.h because the C API of the
+// library returns the same codes.
+#include "libpload.h"
 
 class ExceptionWithExitCode : public std::exception
 {
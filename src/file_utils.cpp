@@ -1,6 +1,15 @@
 #include "file_utils.h"
+#include "compression.h"
 #include <stdexcept>
 
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <sys/stat.h>
+#endif
+
 namespace
 {
     struct noop {
@@ -8,44 +17,127 @@ namespace
     };
 }
 
-std::shared_ptr<std::istream> openFileOrPipeInput(std::string fileName)
+// Windows translates line endings on standard input and output unless they
+// are switched to binary mode.
+static void setBinaryMode(FILE * stream)
+{
+#ifdef _WIN32
+    _setmode(_fileno(stream), _O_BINARY);
+#else
+    (void)stream;
+#endif
+}
+
+std::shared_ptr<std::istream> openFileOrPipeInput(std::string fileName,
+    bool binary)
 {
+    // Input is always read in binary mode, because it might be compressed,
+    // and Windows text mode would change CR LF sequences and stop at the
+    // first 0x1A byte.  The text parsers ignore carriage returns themselves.
     std::shared_ptr<std::istream> file;
     if (fileName == "-")
     {
+        setBinaryMode(stdin);
         file.reset(&std::cin, noop());
     }
     else
     {
         std::ifstream * diskFile = new std::ifstream();
         file.reset(diskFile);
-        diskFile->open(fileName);
+        diskFile->open(fileName, std::ios::in | std::ios::binary);
         if (!*diskFile)
         {
             int error_code = errno;
             throw std::runtime_error(fileName + ": " + strerror(error_code) + ".");
         }
     }
+
+    // Look for the magic bytes of a compressed file.  Standard input can only
+    // be checked one byte ahead, which is enough to tell compressed data from
+    // HEX and FMI files.  Binary data could start with anything, so binary
+    // files also need a compressed file name.
+    uint8_t magic[4];
+    size_t magicSize = 0;
+    bool checkMagic = !binary ||
+        compressionFromFileName(fileName) != COMPRESSION_NONE;
+    if (checkMagic && fileName != "-")
+    {
+        file->read((char *)magic, sizeof(magic));
+        magicSize = file->gcount();
+        file->clear();
+        file->seekg(0);
+    }
+    else if (checkMagic)
+    {
+        int c = file->peek();
+        if (c != EOF) { magic[0] = c; magicSize = 1; }
+        file->clear();
+    }
+
+    CompressionFormat format = compressionFromMagic(magic, magicSize);
+    if (format != COMPRESSION_NONE)
+    {
+        file = openDecompressingInput(file, format, fileName);
+    }
     return file;
 }
 
-std::shared_ptr<std::ostream> openFileOrPipeOutput(std::string fileName)
+std::shared_ptr<std::ostream> openFileOrPipeOutput(std::string fileName,
+    bool binary)
 {
     std::shared_ptr<std::ostream> file;
     if (fileName == "-")
     {
+        if (binary)
+        {
+            std::cout.flush();
+            setBinaryMode(stdout);
+        }
         file.reset(&std::cout, noop());
     }
     else
     {
+        // Compressed files are binary, whatever their contents are.
+        CompressionFormat format = compressionFromFileName(fileName);
+        if (format != COMPRESSION_NONE) { binary = true; }
+
         std::ofstream * diskFile = new std::ofstream();
         file.reset(diskFile);
-        diskFile->open(fileName);
+        diskFile->open(fileName, binary ? std::ios::out | std::ios::binary : std::ios::out);
         if (!*diskFile)
         {
             int error_code = errno;
             throw std::runtime_error(fileName + ": " + strerror(error_code) + ".");
         }
+
+        if (format != COMPRESSION_NONE)
+        {
+            file = openCompressingOutput(file, format, fileName);
+        }
     }
     return file;
 }
+
+void finishOutput(std::ostream & file, const std::string & fileName)
+{
+    finishCompressingOutput(file);
+    file.flush();
+    if (!file)
+    {
+        throw std::runtime_error(fileName + ": Failed to write file.");
+    }
+}
+
+void createDirectory(const std::string & path)
+{
+#ifdef _WIN32
+    int result = _mkdir(path.c_str());
+#else
+    int result = mkdir(path.c_str(), 0777);
+#endif
+    if (result != 0 && errno != EEXIST)
+    {
+        int error_code = errno;
+        throw std::runtime_error(path + ": " + strerror(error_code) + ".");
+    }
+}
@@ -5,5 +5,21 @@
 #include <fstream>
 #include <cstring>
 
-std::shared_ptr<std::istream> openFileOrPipeInput(std::string fileName);
-std::shared_ptr<std::ostream> openFileOrPipeOutput(std::string fileName);
+// These open a file, or standard input or output if the name is "-".  Input
+// that starts with the magic bytes of gzip or zstd data is decompressed, and
+// output to a file named *.gz or *.zst is compressed, on a pipeline thread.
+// Input is always read in binary mode.  For input, binary means the data
+// could start with anything, so only files with compressed file names are
+// checked for magic bytes.  For output, it means not to translate line
+// endings.
+std::shared_ptr<std::istream> openFileOrPipeInput(std::string fileName,
+    bool binary = false);
+std::shared_ptr<std::ostream> openFileOrPipeOutput(std::string fileName,
+    bool binary = false);
+
+// Finishes writing to a stream from openFileOrPipeOutput, and throws an
+// exception if anything could not be written.
+void finishOutput(std::ostream & file, const std::string & fileName);
+
+// Creates a directory if it does not exist yet.
+void createDirectory(const std::string & path);
@@ -143,6 +143,52 @@ static FirmwareArchive::Block processXmlBlock(
     return block;
 }
 
+void FirmwareArchive::Image::setPlainBlocks(const PloaderType & type,
+    const uint8_t * flash)
+{
+    // The plan has exactly the blocks we want, so we just copy them.
+    PloaderPlan plan;
+    plan.writeFlash(type, flash);
+    blocks.clear();
+    for (const PloaderStep & step : plan.steps)
+    {
+        Block block;
+        block.address = step.address;
+        block.data.assign(step.data, step.data + step.size);
+        blocks.push_back(std::move(block));
+    }
+}
+
+/** The blocks of a plain image are just flash data, so they can be arranged
+ * any way we like.  We make them match the flash writes, since the bootloader
+ * always writes one whole block at a time, and leave out the empty ones, so
+ * an archive padded with 0xFF writes as fast as the equivalent HEX file. */
+static void normalizePlainImage(FirmwareArchive::Image & image)
+{
+    const PloaderType * type = ploaderTypeLookup(image.usbVendorId, image.usbProductId);
+    if (type == NULL || !type->supportsFlashPlainWriting)
+    {
+        // We could not write this image anyway.
+        return;
+    }
+
+    MemoryImage flash(type->appSize, 0xFF);
+    for (const FirmwareArchive::Block & block : image.blocks)
+    {
+        if (block.address < type->appAddress ||
+            block.address - type->appAddress > type->appSize ||
+            block.data.size() > type->appAddress + type->appSize - block.address)
+        {
+            throw std::runtime_error(
+                "A block is outside of the application's flash memory.");
+        }
+        std::copy(block.data.begin(), block.data.end(),
+            flash.begin() + (block.address - type->appAddress));
+    }
+
+    image.setPlainBlocks(*type, &flash[0]);
+}
+
 static FirmwareArchive::Image processXmlFirmwareImage(
     const tinyxml2::XMLElement * element)
 {
@@ -214,6 +260,11 @@ static FirmwareArchive::Image processXmlFirmwareImage(
         throw std::runtime_error("An image has no blocks in it.");
     }
 
+    if (image.uploadType == UPLOAD_TYPE_PLAIN)
+    {
+        normalizePlainImage(image);
+    }
+
     return image;
 }
 
@@ -278,6 +329,73 @@ void FirmwareArchive::Data::processXml(std::string string)
     }
 }
 
+static std::string formatHex(uint32_t value, int width)
+{
+    std::ostringstream stream;
+    stream << std::hex << std::uppercase << std::setfill('0')
+        << std::setw(width) << value;
+    return stream.str();
+}
+
+static const char * uploadTypeName(uint16_t uploadType)
+{
+    switch (uploadType)
+    {
+    case UPLOAD_TYPE_DEVICE_SPECIFIC: return "DeviceSpecific";
+    case UPLOAD_TYPE_PLAIN: return "Plain";
+    default: return "Standard";
+    }
+}
+
+void FirmwareArchive::Data::writeToFile(std::ostream & file) const
+{
+    static const char hexDigits[] = "0123456789ABCDEF";
+
+    tinyxml2::XMLPrinter printer;
+    printer.PushHeader(false, true);
+    printer.OpenElement("FirmwareArchive");
+    printer.PushAttribute("format", "1.0");
+    if (!name.empty())
+    {
+        printer.PushAttribute("name", name.c_str());
+    }
+
+    for (const Image & image : images)
+    {
+        // FMI files do not store the vendor ID; see processXmlFirmwareImage.
+        if (image.usbVendorId != USB_VENDOR_ID_POLOLU)
+        {
+            throw std::runtime_error("FMI files can only hold images for Pololu products.");
+        }
+
+        printer.OpenElement("FirmwareImage");
+        printer.PushAttribute("product", formatHex(image.usbProductId, 4).c_str());
+        printer.PushAttribute("uploadType", uploadTypeName(image.uploadType));
+
+        for (const Block & block : image.blocks)
+        {
+            std::string contents;
+            contents.reserve(block.data.size() * 2);
+            for (uint8_t byte : block.data)
+            {
+                contents += hexDigits[byte >> 4];
+                contents += hexDigits[byte & 0xF];
+            }
+
+            printer.OpenElement("Block");
+            printer.PushAttribute("address", formatHex(block.address, 4).c_str());
+            printer.PushText(contents.c_str());
+            printer.CloseElement();
+        }
+
+        printer.CloseElement();
+    }
+
+    printer.CloseElement();
+
+    file << printer.CStr();
+}
+
 void FirmwareArchive::Data::readFromFile(std::istream & file,
     const char * fileName)
 {
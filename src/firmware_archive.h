@@ -6,7 +6,9 @@
 #include <cstdint>
 #include <cassert>
 
-// Class for reading Firmware Archive (.fmi) files.
+class PloaderType;
+
+// Class for reading and writing Firmware Archive (.fmi) files.
 namespace FirmwareArchive
 {
     class Block
@@ -23,6 +25,12 @@ namespace FirmwareArchive
         uint16_t usbProductId;
         uint16_t uploadType;
         std::vector<Block> blocks;
+
+        /** Replaces the blocks with ones that write the specified flash
+         * image, which must be type.appSize bytes.  There is one block per
+         * flash write, in the descending order PloaderPlan::writeFlash uses,
+         * and empty blocks are left out. */
+        void setPlainBlocks(const PloaderType & type, const uint8_t * flash);
     };
 
     class Data
@@ -30,6 +38,10 @@ namespace FirmwareArchive
     public:
         void readFromFile(std::istream & file, const char * fileName);
 
+        /** Writes the archive as XML in the format that readFromFile
+         * reads. */
+        void writeToFile(std::ostream & file) const;
+
         operator bool() const
         {
             return !images.empty();
@@ -51,6 +51,35 @@ void FirmwareData::readFromFile(const char * fileName)
     }
 }
 
+void FirmwareData::readBinaryFromFile(const char * fileName, uint32_t baseAddress)
+{
+    assert(!*this);
+
+    std::string fileNameStr(fileName);
+
+    auto filePtr = openFileOrPipeInput(fileNameStr, true);
+    std::vector<uint8_t> image((std::istreambuf_iterator<char>(*filePtr)),
+        std::istreambuf_iterator<char>());
+    if (filePtr->bad())
+    {
+        throw std::runtime_error(fileNameStr + ": Failed to read file.");
+    }
+
+    if ((uint64_t)baseAddress + image.size() > 0x100000000)
+    {
+        throw std::runtime_error(fileNameStr + ": file is too large for its base address.");
+    }
+
+    // The data goes in as one entry, since there are no records to keep.
+    uint32_t size = image.size();
+    hexData.setImage(baseAddress, std::move(image), size);
+
+    if (!*this)
+    {
+        throw std::runtime_error(fileNameStr + ": file contains no firmware data.");
+    }
+}
+
 void FirmwareData::ensureBootloaderCompatibility(const PloaderType & type,
     MemorySet memorySet) const
 {
@@ -89,8 +118,64 @@ void FirmwareData::ensureBootloaderCompatibility(const PloaderType & type,
 void FirmwareData::writeToBootloader(PloaderHandle & handle,
     MemorySet memorySet) const
 {
-    const PloaderType & type = handle.type;
+    handle.executePlan(getWritePlan(*handle.type, memorySet));
+}
+
+FirmwareArchive::Image FirmwareData::makeArchiveImage(
+    const PloaderType & type) const
+{
+    if (!hexData)
+    {
+        throw std::runtime_error("Only HEX and binary files can be put in an FMI file.");
+    }
 
+    type.ensureFlashPlainWriting();
+
+    // An FMI file cannot hold EEPROM data, so do not lose it silently.
+    if (type.supportsEepromAccess)
+    {
+        MemoryImage eeprom = hexData.getImage(type.eepromAddressHexFile, type.eepromSize);
+        if (!memoryIsBlank(&eeprom[0], eeprom.size()))
+        {
+            throw std::runtime_error(
+                "The file has EEPROM data, which cannot be put in an FMI file.");
+        }
+    }
+
+    FirmwareArchive::Image image;
+    image.usbVendorId = type.usbVendorId;
+    image.usbProductId = type.usbProductId;
+    image.uploadType = UPLOAD_TYPE_PLAIN;
+
+    MemoryImage flash = hexData.getImage(type.appAddress, type.appSize);
+    image.setPlainBlocks(type, &flash[0]);
+
+    if (image.blocks.empty())
+    {
+        throw std::runtime_error("The file has no data in the application's flash memory.");
+    }
+
+    return image;
+}
+
+const PloaderPlan & FirmwareData::getWritePlan(const PloaderType & type,
+    MemorySet memorySet) const
+{
+    std::lock_guard<std::mutex> lock(writePlansMutex);
+
+    std::unique_ptr<PloaderPlan> & plan = writePlans[std::make_pair(&type, memorySet)];
+    if (!plan)
+    {
+        std::unique_ptr<PloaderPlan> newPlan(new PloaderPlan());
+        addWriteSteps(type, memorySet, *newPlan);
+        plan = std::move(newPlan);
+    }
+    return *plan;
+}
+
+void FirmwareData::addWriteSteps(const PloaderType & type, MemorySet memorySet,
+    PloaderPlan & plan) const
+{
     if (hexData)
     {
         // EEPROM is written before flash to ensure there is no risk of running
@@ -99,27 +184,27 @@ void FirmwareData::writeToBootloader(PloaderHandle & handle,
 
         if (type.memorySetIncludesFlash(memorySet))
         {
-            handle.initialize(UPLOAD_TYPE_PLAIN);
-            handle.eraseFlash();
+            plan.initialize(UPLOAD_TYPE_PLAIN);
+            plan.eraseFlash();
         }
 
         if (type.memorySetIncludesEeprom(memorySet))
         {
             MemoryImage eeprom = hexData.getImage(type.eepromAddressHexFile, type.eepromSize);
-            handle.writeEeprom(&eeprom[0]);
+            plan.writeEeprom(type, &eeprom[0]);
         }
 
         if (type.memorySetIncludesFlash(memorySet))
         {
             MemoryImage flash = hexData.getImage(type.appAddress, type.appSize);
-            handle.writeFlash(&flash[0]);
+            plan.writeFlash(type, &flash[0]);
         }
     }
     else if (firmwareArchiveData)
     {
         const FirmwareArchive::Image & image = firmwareArchiveData.findImage(
             type.usbVendorId, type.usbProductId);
-        handle.applyImage(image);
+        plan.applyImage(type, image);
     }
     else
     {
@@ -13,14 +13,38 @@ class FirmwareData
 public:
     void readFromFile(const char * fileName);
 
+    /** Reads a raw binary file whose first byte goes at baseAddress, using
+     * the same addresses as a HEX file. */
+    void readBinaryFromFile(const char * fileName, uint32_t baseAddress);
+
     /** Raises an exception if the specified memory sets from this data
      * cannot be written to the specified type of bootloader. */
     void ensureBootloaderCompatibility(const PloaderType &, MemorySet) const;
 
     void writeToBootloader(PloaderHandle &, MemorySet) const;
 
+    /** Makes a firmware archive image with the flash data from a HEX file
+     * for the specified type of bootloader, which must support plain
+     * writing.  There is one block per flash write, in the order that
+     * writeFlash uses, and empty blocks are left out. */
+    FirmwareArchive::Image makeArchiveImage(const PloaderType &) const;
+
+    /** Returns the plan that writeToBootloader uses.  Each plan is made the
+     * first time it is needed, and then shared by all the devices of that
+     * type, so we only make the images and look for the empty blocks once.
+     * This is safe to call from several threads.  The plan is valid as long
+     * as this object is. */
+    const PloaderPlan & getWritePlan(const PloaderType &, MemorySet) const;
+
     operator bool() const;
 
     IntelHex::Data hexData;
     FirmwareArchive::Data firmwareArchiveData;
+
+private:
+    void addWriteSteps(const PloaderType &, MemorySet, PloaderPlan &) const;
+
+    mutable std::mutex writePlansMutex;
+    mutable std::map<std::pair<const PloaderType *, MemorySet>,
+        std::unique_ptr<PloaderPlan>> writePlans;
 };
@@ -9,6 +9,8 @@
 #include <algorithm>
 #include <typeinfo>
 #include <stdexcept>
+#include <thread>
+#include <cstring>
 
 using namespace IntelHex;
 
@@ -20,89 +22,95 @@ static int hexDigitValue(unsigned char c)
     return -1;
 }
 
-static uint8_t readHexByte(std::istream & s)
+// Files at least this big are parsed on several threads.
+#define INTEL_HEX_PARALLEL_SIZE 0x100000
+
+// The smallest piece of a file that gets its own thread.
+#define INTEL_HEX_MIN_CHUNK_SIZE 0x40000
+
+// Reads a byte written as two hex digits, advancing p.
+static uint8_t readHexByte(const char *& p, const char * end)
 {
-    std::istream::sentry sentry(s, true);
-    if (sentry)
+    if (end - p < 2)
     {
-        char c1 = 0, c2 = 0;
-        s.get(c1);
-        s.get(c2);
-
-        if (s.fail())
-        {
-            if (s.eof())
-            {
-                throw std::runtime_error("Unexpected end of line.");
-            }
-            else
-            {
-                throw std::runtime_error("Failed to read hex digit.");
-            }
-        }
+        throw std::runtime_error("Unexpected end of line.");
+    }
 
-        int v1 = hexDigitValue(c1);
-        int v2 = hexDigitValue(c2);
+    int v1 = hexDigitValue(p[0]);
+    int v2 = hexDigitValue(p[1]);
+    p += 2;
 
-        if (v1 < 0 || v2 < 0)
-        {
-            throw std::runtime_error("Invalid hex digit.");
-        }
-
-        return v1 * 16 + v2;
+    if (v1 < 0 || v2 < 0)
+    {
+        throw std::runtime_error("Invalid hex digit.");
     }
-    return 0;
+
+    return v1 * 16 + v2;
 }
 
-static uint16_t readHexShort(std::istream & s)
+static uint16_t readHexShort(const char *& p, const char * end)
 {
-    uint16_t r = readHexByte(s) << 8;
-    return r + readHexByte(s);
+    uint16_t r = readHexByte(p, end) << 8;
+    return r + readHexByte(p, end);
 }
 
-// Returns true if the line indicates the HEX file is done.
-static void processLine(std::istream & file,
-    std::vector<IntelHex::Entry> & entries,
-    uint16_t & addressHigh,
-    bool & done)
+namespace
 {
-    std::string lineString;
-    std::getline(file, lineString);
-    if (file.fail())
+    // What we found in one chunk of a HEX file, which is some whole lines.
+    // The chunks are parsed separately, so the data records before the
+    // first Extended Linear Address record of a chunk get their high address
+    // bits later, from the chunks before it.
+    struct ChunkResult
     {
-        if (file.eof())
-        {
-            throw std::runtime_error("Unexpected end of file.");
-        }
-        else
+        ChunkResult() : entriesWithoutHigh(0), setsAddressHigh(false),
+            addressHigh(0), lineCount(0), done(false)
         {
-            throw std::runtime_error("Failed to read HEX file line.");
         }
-    }
 
-    std::istringstream lineStream(lineString);
+        std::vector<IntelHex::Entry> entries;
+
+        // The number of entries at the start of the list that come before
+        // any Extended Linear Address record in this chunk.
+        size_t entriesWithoutHigh;
+
+        // The high 16 bits of the address set by the last Extended Linear
+        // Address record in this chunk, if any.
+        bool setsAddressHigh;
+        uint16_t addressHigh;
+
+        // The number of lines read.  If there was an error or an End of File
+        // record, this is the number of the line it was on.
+        uint32_t lineCount;
 
-    char start;
-    lineStream.get(start);
-    if (start != ':')
+        bool done;
+        std::string error;
+    };
+}
+
+// Parses a line, not including the newline.  Returns true if the line
+// indicates the HEX file is done.
+static bool processLine(const char * p, const char * end, ChunkResult & result)
+{
+    if (p == end || *p != ':')
     {
         throw std::runtime_error("Hex line does not start with colon (:).");
     }
+    p++;
 
     // Read the indentifying information of the line.
-    uint8_t byteCount = readHexByte(lineStream);
-    uint16_t addressLow = readHexShort(lineStream);
-    uint8_t recordType = readHexByte(lineStream);
+    uint8_t byteCount = readHexByte(p, end);
+    uint16_t addressLow = readHexShort(p, end);
+    uint8_t recordType = readHexByte(p, end);
 
     // Read the data
     std::vector<uint8_t> data(byteCount);
     for(uint32_t i = 0; i < byteCount; i++)
     {
-        data[i] = readHexByte(lineStream);
+        data[i] = readHexByte(p, end);
     }
 
     // Read the checksum.
-    uint8_t checksum = readHexByte(lineStream);
+    uint8_t checksum = readHexByte(p, end);
 
     // Check the checksum.
     uint8_t sum = byteCount + (addressLow & 0xFF) + (addressLow >> 8) + recordType;
@@ -122,9 +130,8 @@ static void processLine(std::istream & file,
     }
 
     // Check for extra stuff at the end of the line, ignoring carriage returns.
-    int extra;
-    do { extra = lineStream.get(); } while (extra == '\r');
-    if (extra != EOF)
+    while (p != end && *p == '\r') { p++; }
+    if (p != end)
     {
         throw std::runtime_error("Extra data after checksum.");
     }
@@ -140,7 +147,12 @@ static void processLine(std::istream & file,
             throw std::runtime_error("Extended Linear Address record has "
                 "wrong number of bytes (expected 2).");
         }
-        addressHigh = (data[0] << 8) + data[1];
+        if (!result.setsAddressHigh)
+        {
+            result.entriesWithoutHigh = result.entries.size();
+            result.setsAddressHigh = true;
+        }
+        result.addressHigh = (data[0] << 8) + data[1];
         break;
 
     case 2:  // Extended Segment Address Record (basically sets bits 4-20 of the address)
@@ -149,8 +161,8 @@ static void processLine(std::istream & file,
 
     case 0:  // Data record
     {
-        uint32_t address = addressLow + (addressHigh << 16);
-        entries.push_back(Entry(address, data));
+        uint32_t address = addressLow + ((uint32_t)result.addressHigh << 16);
+        result.entries.push_back(Entry(address, std::move(data)));
         break;
     }
 
@@ -159,17 +171,46 @@ static void processLine(std::istream & file,
         break;
 
     case 1: // End of File record
-        done = true;
-        break;
+        return true;
+    }
+    return false;
+}
+
+// Parses lines until the end of the chunk, an error, or an End of File
+// record.
+static void processChunk(const char * p, const char * end, ChunkResult & result)
+{
+    try
+    {
+        while (p != end)
+        {
+            const char * lineEnd = (const char *)memchr(p, '\n', end - p);
+            if (lineEnd == NULL) { lineEnd = end; }
+
+            result.lineCount++;
+            if (processLine(p, lineEnd, result))
+            {
+                result.done = true;
+                break;
+            }
+
+            p = lineEnd == end ? end : lineEnd + 1;
+        }
+    }
+    catch (const std::runtime_error & e)
+    {
+        result.error = e.what();
+    }
+
+    if (!result.setsAddressHigh)
+    {
+        result.entriesWithoutHigh = result.entries.size();
     }
 }
 
 void IntelHex::Data::readFromFile(std::istream & file,
     const char * fileName, uint32_t * lineNumber)
 {
-    // Assume the high 16 bits of the address are zero initially.
-    uint16_t addressHigh = 0;
-
     assert(fileName != NULL);
 
     uint32_t internalLineNumber = 0;
@@ -178,23 +219,88 @@ void IntelHex::Data::readFromFile(std::istream & file,
         lineNumber = &internalLineNumber;
     }
 
-    try
+    // Read the whole file so we can split it up.
+    std::string text;
+    char buffer[0x10000];
+    while (file.read(buffer, sizeof(buffer)) || file.gcount())
     {
-        while(1)
-        {
-            (*lineNumber)++;
-            bool done = false;
-            processLine(file, entries, addressHigh, done);
-            if (done) { break; }
-        }
+        text.append(buffer, file.gcount());
+    }
+    if (file.bad())
+    {
+        throw std::runtime_error(std::string(fileName) +
+            ": Failed to read HEX file.");
+    }
+
+    // Split big files into chunks of whole lines, one per thread.
+    size_t chunkCount = 1;
+    if (text.size() >= INTEL_HEX_PARALLEL_SIZE)
+    {
+        chunkCount = std::max(1u, std::thread::hardware_concurrency());
+        chunkCount = std::min(chunkCount, text.size() / INTEL_HEX_MIN_CHUNK_SIZE);
+    }
+    std::vector<const char *> bounds(1, text.data());
+    for (size_t i = 1; i < chunkCount; i++)
+    {
+        const char * end = text.data() + text.size();
+        const char * p = std::max(bounds.back(), text.data() + text.size() * i / chunkCount);
+        const char * newline = (const char *)memchr(p, '\n', end - p);
+        if (newline == NULL) { break; }
+        bounds.push_back(newline + 1);
+    }
+    bounds.push_back(text.data() + text.size());
+
+    std::vector<ChunkResult> results(bounds.size() - 1);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < results.size(); i++)
+    {
+        threads.emplace_back(processChunk, bounds[i], bounds[i + 1], std::ref(results[i]));
+    }
+    processChunk(bounds[0], bounds[1], results[0]);
+    for (std::thread & thread : threads)
+    {
+        thread.join();
     }
-    catch(const std::runtime_error & e)
+
+    // Put the chunks together in order, giving each one the high address
+    // bits from the chunks before it (we assume they are zero initially),
+    // and stopping at the first error or End of File record.
+    uint16_t addressHigh = 0;
+    for (ChunkResult & result : results)
     {
-        throw std::runtime_error(
-            std::string(fileName) + ":" +
-            std::to_string(*lineNumber) + ": " +
-            std::string(e.what()));
+        if (addressHigh != 0)
+        {
+            for (size_t i = 0; i < result.entriesWithoutHigh; i++)
+            {
+                result.entries[i].address += (uint32_t)addressHigh << 16;
+            }
+        }
+
+        entries.insert(entries.end(),
+            std::make_move_iterator(result.entries.begin()),
+            std::make_move_iterator(result.entries.end()));
+
+        *lineNumber += result.lineCount;
+
+        if (!result.error.empty())
+        {
+            throw std::runtime_error(
+                std::string(fileName) + ":" +
+                std::to_string(*lineNumber) + ": " + result.error);
+        }
+
+        if (result.done) { return; }
+
+        if (result.setsAddressHigh)
+        {
+            addressHigh = result.addressHigh;
+        }
     }
+
+    (*lineNumber)++;
+    throw std::runtime_error(
+        std::string(fileName) + ":" +
+        std::to_string(*lineNumber) + ": Unexpected end of file.");
 }
 
 std::vector<uint8_t> IntelHex::Data::getImage(uint32_t startAddress, uint32_t size) const
@@ -289,3 +395,9 @@ void IntelHex::Data::writeToFile(std::ostream & file) const
     }
     writeHexLine(file, 1, 0, {});  // End of file.
 }
+
+void IntelHex::Data::add(const Data & other)
+{
+    // getImage applies the entries in order, so later ones win.
+    entries.insert(entries.end(), other.entries.begin(), other.entries.end());
+}
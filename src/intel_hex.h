@@ -4,6 +4,7 @@
 #include <vector>
 #include <iostream>
 #include <cstdint>
+#include <utility>
 
 namespace IntelHex
 {
@@ -11,7 +12,7 @@ namespace IntelHex
     {
     public:
         Entry(uint32_t address, std::vector<uint8_t> data)
-            : address(address), data(data)
+            : address(address), data(std::move(data))
         {
         }
 
@@ -22,6 +23,9 @@ namespace IntelHex
     class Data
     {
     public:
+        /** Reads a HEX file.  Big files are split into chunks of lines
+         * that are parsed on separate threads, with the same results and
+         * error messages as parsing them one line at a time. */
         void readFromFile(std::istream & file, const char * fileName,
             uint32_t * lineNumber = NULL);
 
@@ -32,6 +36,10 @@ namespace IntelHex
         void setImage(uint32_t startAddress, std::vector<uint8_t> image,
             uint32_t blockSize = 16);
 
+        /** Adds the data from another HEX file.  Where both have data for
+         * the same address, getImage returns the data from the other one. */
+        void add(const Data & other);
+
         operator bool() const
         {
             return !entries.empty();
@@ -0,0 +1,217 @@
+// The C interface of libpload, which is a thin layer over Session.
+
+#include "p-load.h"
+#include "libpload.h"
+#include "session.h"
+#include <list>
+
+// Passes progress from the session to the user's callback.
+class CallbackListener : public PloaderStatusListener
+{
+public:
+    CallbackListener() : callback(NULL), context(NULL) { }
+
+    void setStatus(const char * status, uint32_t progress, uint32_t maxProgress)
+    {
+        if (callback) { callback(context, status, progress, maxProgress); }
+    }
+
+    pload_progress_callback * callback;
+    void * context;
+};
+
+struct pload_session
+{
+    Session session;
+    CallbackListener listener;
+    std::string errorMessage;
+
+    // The files to save after the session runs, and the data read for them.
+    // Elements of a list do not move, so the session can point to them.
+    std::list<std::pair<std::string, IntelHex::Data>> readFiles;
+};
+
+// Runs a function, records any error it throws, and returns an error code.
+template <typename F>
+static int tryCall(pload_session * s, F function)
+{
+    assert(s != NULL);
+    s->errorMessage.clear();
+    try
+    {
+        function();
+        return 0;
+    }
+    catch (const ExceptionWithExitCode & error)
+    {
+        s->errorMessage = error.message();
+        return error.getCode();
+    }
+    catch (const std::exception & error)
+    {
+        s->errorMessage = error.what();
+        return PLOAD_ERROR_OPERATION_FAILED;
+    }
+}
+
+static MemorySet memorySetFromInt(int memory)
+{
+    switch (memory)
+    {
+    case PLOAD_MEMORY_ALL: return MEMORY_SET_ALL;
+    case PLOAD_MEMORY_FLASH: return MEMORY_SET_FLASH;
+    case PLOAD_MEMORY_EEPROM: return MEMORY_SET_EEPROM;
+    }
+    throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+        "Invalid memory: " + std::to_string(memory) + ".");
+}
+
+static void ensureString(const char * str)
+{
+    if (str == NULL)
+    {
+        throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+            "A required string argument is NULL.");
+    }
+}
+
+pload_session * pload_session_create(void)
+{
+    try
+    {
+        pload_session * s = new pload_session();
+        s->session.setStatusListener(&s->listener);
+        return s;
+    }
+    catch (const std::bad_alloc &)
+    {
+        return NULL;
+    }
+}
+
+void pload_session_free(pload_session * s)
+{
+    delete s;
+}
+
+int pload_session_select_type(pload_session * s, const char * type)
+{
+    return tryCall(s, [&]() {
+        ensureString(type);
+        const PloaderUserType * userType = ploaderUserTypeLookup(type);
+        if (userType == NULL)
+        {
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                std::string("Unknown type: '") + type + "'.");
+        }
+        s->session.specifyUserType(*userType);
+    });
+}
+
+int pload_session_select_serial_number(pload_session * s, const char * serial_number)
+{
+    return tryCall(s, [&]() {
+        ensureString(serial_number);
+        s->session.specifySerialNumber(serial_number);
+    });
+}
+
+int pload_session_select_port(pload_session * s, const char * port_path)
+{
+    return tryCall(s, [&]() {
+        ensureString(port_path);
+        s->session.specifyPortPath(port_path);
+    });
+}
+
+void pload_session_set_wait_timeout(pload_session * s, uint32_t seconds)
+{
+    s->session.setWaitTimeout(seconds);
+}
+
+void pload_session_set_progress_callback(pload_session * s,
+    pload_progress_callback * callback, void * context)
+{
+    s->listener.callback = callback;
+    s->listener.context = context;
+}
+
+int pload_session_write(pload_session * s, int memory, const char * file_name)
+{
+    return tryCall(s, [&]() {
+        ensureString(file_name);
+        MemorySet ms = memorySetFromInt(memory);
+        std::shared_ptr<FirmwareData> data(new FirmwareData());
+        data->readFromFile(file_name);
+        s->session.write(data, ms);
+    });
+}
+
+int pload_session_write_binary(pload_session * s, int memory,
+    const char * file_name, uint32_t base_address)
+{
+    return tryCall(s, [&]() {
+        ensureString(file_name);
+        MemorySet ms = memorySetFromInt(memory);
+        std::shared_ptr<FirmwareData> data(new FirmwareData());
+        data->readBinaryFromFile(file_name, base_address);
+        s->session.write(data, ms);
+    });
+}
+
+int pload_session_erase(pload_session * s, int memory)
+{
+    return tryCall(s, [&]() {
+        s->session.erase(memorySetFromInt(memory));
+    });
+}
+
+int pload_session_read(pload_session * s, int memory, const char * file_name)
+{
+    return tryCall(s, [&]() {
+        ensureString(file_name);
+        MemorySet ms = memorySetFromInt(memory);
+        s->readFiles.emplace_back(file_name, IntelHex::Data());
+        s->session.read(ms, s->readFiles.back().second);
+    });
+}
+
+void pload_session_restart(pload_session * s, int wait_for_app)
+{
+    s->session.restart(wait_for_app != 0);
+}
+
+void pload_session_clear_operations(pload_session * s)
+{
+    s->session.clearOperations();
+    s->readFiles.clear();
+}
+
+int pload_session_run(pload_session * s)
+{
+    return tryCall(s, [&]() {
+        for (auto & file : s->readFiles)
+        {
+            file.second = IntelHex::Data();
+        }
+
+        s->session.run();
+
+        for (const auto & file : s->readFiles)
+        {
+            auto filePtr = openFileOrPipeOutput(file.first);
+            file.second.writeToFile(*filePtr);
+            finishOutput(*filePtr, file.first);
+        }
+    });
+}
+
+const char * pload_session_serial_number(const pload_session * s)
+{
+    return s->session.serialNumber().c_str();
+}
+
+const char * pload_session_error_message(const pload_session * s)
+{
+    return s->errorMessage.c_str();
+}
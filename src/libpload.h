@@ -0,0 +1,106 @@
+/* libpload.h: The C interface of the libpload library, which lets other
+ * programs load firmware onto Pololu USB bootloaders without running the
+ * p-load executable.
+ *
+ * A pload_session selects one device and runs a list of operations on it.
+ * Sessions are independent, so a program can use several at once from
+ * different threads, as long as each session is used by one thread at a
+ * time.  A session can be run again to program another device.
+ *
+ * Functions that can fail return 0 on success or one of the PLOAD_ERROR
+ * codes below, which are the same as the exit codes of p-load.  Call
+ * pload_session_error_message to get a description of the last error. */
+
+#pragma once
+
+#include <stdint.h>
+
+/* PLOAD_API marks the functions that the shared library exports.  Programs
+ * that link the static library on Windows should define PLOAD_STATIC. */
+#if defined(_WIN32) && defined(PLOAD_EXPORTS)
+#define PLOAD_API __declspec(dllexport)
+#elif defined(_WIN32) && !defined(PLOAD_STATIC)
+#define PLOAD_API __declspec(dllimport)
+#elif defined(__GNUC__)
+#define PLOAD_API __attribute__((visibility("default")))
+#else
+#define PLOAD_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PLOAD_ERROR_BAD_ARGS 1
+#define PLOAD_ERROR_OPERATION_FAILED 2
+#define PLOAD_ERROR_DEVICE_NOT_FOUND 3
+#define PLOAD_ERROR_DEVICE_MULTIPLE_FOUND 4
+#define PLOAD_ERROR_DEVICE_IN_USE 5
+#define PLOAD_ERROR_APP_NOT_RUNNING 6
+#define PLOAD_ERROR_MEMORY_MISMATCH 7
+
+/* Memory regions for the memory arguments below. */
+#define PLOAD_MEMORY_ALL 0
+#define PLOAD_MEMORY_FLASH 1
+#define PLOAD_MEMORY_EEPROM 2
+
+typedef struct pload_session pload_session;
+
+/* A function that is called with the status and progress of long
+ * operations, from the thread that called pload_session_run. */
+typedef void pload_progress_callback(void * context, const char * status,
+    uint32_t progress, uint32_t max_progress);
+
+/* Returns a new session, or NULL if there is not enough memory. */
+PLOAD_API pload_session * pload_session_create(void);
+
+PLOAD_API void pload_session_free(pload_session *);
+
+/* These functions restrict which devices can be selected, like the -t, -d,
+ * and -p options of p-load.  type is a name like "p-star". */
+PLOAD_API int pload_session_select_type(pload_session *, const char * type);
+PLOAD_API int pload_session_select_serial_number(pload_session *, const char * serial_number);
+PLOAD_API int pload_session_select_port(pload_session *, const char * port_path);
+
+/* Sets how long to wait for the bootloader and app, in seconds. */
+PLOAD_API void pload_session_set_wait_timeout(pload_session *, uint32_t seconds);
+
+PLOAD_API void pload_session_set_progress_callback(pload_session *,
+    pload_progress_callback *, void * context);
+
+/* Adds an operation that writes a HEX or FMI file to the device.  The file is
+ * read right away. */
+PLOAD_API int pload_session_write(pload_session *, int memory, const char * file_name);
+
+/* Adds an operation that writes a raw binary file to the device, like a .bin
+ * file with the --base option of p-load.  The first byte of the file goes at
+ * base_address, which uses the same addresses as a HEX file. */
+PLOAD_API int pload_session_write_binary(pload_session *, int memory,
+    const char * file_name, uint32_t base_address);
+
+/* Adds an operation that erases memory on the device. */
+PLOAD_API int pload_session_erase(pload_session *, int memory);
+
+/* Adds an operation that reads memory from the device and saves it in a HEX
+ * file after the session runs successfully. */
+PLOAD_API int pload_session_read(pload_session *, int memory, const char * file_name);
+
+/* Makes the session restart the device after the other operations, and
+ * optionally wait for its app to start. */
+PLOAD_API void pload_session_restart(pload_session *, int wait_for_app);
+
+/* Removes the operations, keeping the device selection and settings. */
+PLOAD_API void pload_session_clear_operations(pload_session *);
+
+/* Gets a device into bootloader mode and runs the operations on it. */
+PLOAD_API int pload_session_run(pload_session *);
+
+/* Returns the serial number of the device used by the last run. */
+PLOAD_API const char * pload_session_serial_number(const pload_session *);
+
+/* Returns a description of the last error, or an empty string. */
+PLOAD_API const char * pload_session_error_message(const pload_session *);
+
+#ifdef __cplusplus
+}
+#endif
@@ -10,10 +10,13 @@ static const char help[] =
     "Options available:\n"
     "  -t TYPE                     Specifies device type (e.g. p-star).\n"
     "  -d SERIALNUMBER             Specifies the serial number of the device.\n"
+    "  -p PORT                     Specifies the USB port of the device (e.g. 1-2.3).\n"
     "  --list                      Lists devices connected to computer.\n"
     "  --list-supported            Lists all supported device types.\n"
     "  --start-bootloader          Gets the device into bootloader mode.\n"
-    "  --wait                      Waits up to 10 seconds for bootloader to appear.\n"
+    "  --wait                      Waits for bootloader to appear.\n"
+    "  --wait-count N              Waits until N qualifying devices are present.\n"
+    "  --timeout SECONDS           Sets how long to wait for devices (default 10).\n"
     "  -w FILE                     Writes to device, then restarts it.\n"
     "  --write FILE                Writes to device.\n"
     "  --write-flash HEXFILE       Writes to flash only.\n"
@@ -24,18 +27,62 @@ static const char help[] =
     "  --read HEXFILE              Reads from device and saves to file.\n"
     "  --read-flash HEXFILE        Reads flash only and saves to file.\n"
     "  --read-eeprom HEXFILE       Reads EEPROM only and saves to file.\n"
+    "  --base ADDR                 Sets the address where later .bin files start.\n"
+    "  --read-format FORMAT        Sets the format of files read (hex or bin).\n"
+    "  --merge                     Merges the files of consecutive writes into one.\n"
+    "  --diff FILE                 Shows how the device differs from the file.\n"
+    "  --json                      Prints the --diff report as JSON.\n"
     "  --restart                   Restarts the device so it can run the new code.\n"
+    "  --wait-app                  Restarts the device and waits for its app.\n"
+    "  --all                       Operates on all qualifying devices at once.\n"
+    "  --watch                     Stays running and handles each new device.\n"
+    "  --batch FILE                Runs the jobs listed in FILE, one per line.\n"
+    "  --single-thread             Uses one thread for --all, --batch, and --watch.\n"
+    "  --max-per-bus N             Limits busy devices per USB bus (default 4).\n"
+    "  --dry-run                   Shows what the actions would do and how long.\n"
+    "  --timing MODEL              Sets the timing model used by --dry-run.\n"
+    "  --stats                     Shows how long the bootloader operations took.\n"
+    "  --snapshot DIR              Reads all qualifying devices and saves to DIR.\n"
+    "  --make-fmi FMIFILE          Makes an FMI file from the --fmi-image files.\n"
+    "  --fmi-image TYPE FILE       Puts FILE in the FMI file for each TYPE device.\n"
     "  --pause-on-error            Pause at the end if an error happens.\n"
     "  --pause                     Pause at the end.\n"
     "  -h, --help                  Show this help screen.\n"
     "\n"
     "HEXFILE is the name of the .HEX file to be used.\n"
-    "FILE is the name of the .HEX or .FMI file to be used.\n"
+    "FILE is the name of the .HEX, .FMI, or .BIN file to be used.\n"
+    "A .BIN file has raw data starting at the address given by --base, using the\n"
+    "same addresses as a HEX file.\n"
+    "Files compressed with gzip or zstd are read directly, and files read from the\n"
+    "device are compressed if their names end with .gz or .zst.\n"
+    "Without --merge, each write erases flash first, so writing two files leaves\n"
+    "only the flash data from the last one.  With --merge, consecutive writes of\n"
+    "the same memory are combined into one image, and where the files overlap, the\n"
+    "later file wins.  --merge does not work with .FMI files.\n"
+    "For --read-flash and --read-eeprom, HEXFILE@START:LEN reads only LEN bytes\n"
+    "starting at address START, using the same addresses as the HEX file.\n"
+    "Each line of a batch FILE has the -t, -d, -p, and action options for one job.\n"
+    "--snapshot saves each different image once in DIR, named by its SHA-256\n"
+    "hash, and lists the hashes of each device in DIR/manifest.csv.\n"
+    "--make-fmi only supports devices that accept plain HEX files (e.g. p-star).\n"
+    "MODEL has durations in milliseconds, like the one --stats prints:\n"
+    "  init=1,erase=1150,flash-write=2,eeprom-write=130,flash-read=3,...\n"
     "\n"
     "Example: p-load -t p-star -w app.hex\n"
     "Example: p-load -w pgm04a-v1.00.fmi\n"
     "Example: p-load -d 12345678 --wait --write-flash app.hex --restart\n"
+    "Example: p-load -p 1-2.3 -w app.hex\n"
+    "Example: p-load -d 12345678 --read-flash serial.hex@0x7FC0:64\n"
     "Example: p-load -t p-star --erase\n"
+    "Example: p-load -d 12345678 --diff app.hex\n"
+    "Example: p-load -t p-star --base 0x2000 -w app.bin\n"
+    "Example: p-load -t p-star --merge --write boot.hex -w app.hex\n"
+    "Example: p-load -d 12345678 --read-format bin --read-flash flash.bin\n"
+    "Example: p-load -t p-star --all -w app.hex\n"
+    "Example: p-load --watch -w pgm04a-v1.00.fmi\n"
+    "Example: p-load -t p-star --dry-run -w app.hex\n"
+    "Example: p-load -t p-star --snapshot rack1 --restart\n"
+    "Example: p-load --make-fmi app.fmi --fmi-image p-star app.hex\n"
     "\n";
 
 // GCC 4.6 doesn't support the override keyword.
@@ -45,44 +92,95 @@ static const char help[] =
 
 class Action;
 
-static DeviceSelector selector;
+/* A Job holds the device selection and the actions for one device.  The
+ * command line specifies one job, and each line of a batch manifest specifies
+ * another. */
+struct Job
+{
+    Job() : startBootloaderFlag(false), restartBootloaderFlag(false),
+        waitForAppFlag(false), mergeWritesFlag(false), baseAddress(-1)
+    {
+    }
+
+    ~Job();
+
+    Job(const Job &) = delete;
+    Job & operator=(const Job &) = delete;
+
+    // Returns true if we actually want to get to the state where a
+    // bootloader is connected to the computer and we have selected it.
+    bool bootloaderHandleNeeded() const
+    {
+        return startBootloaderFlag ||
+            restartBootloaderFlag ||
+            actions.size() > 0;
+    }
+
+    DeviceSelector selector;
+    std::vector<Action *> actions;
+    bool startBootloaderFlag;
+    bool restartBootloaderFlag;
+    bool waitForAppFlag;
+    bool mergeWritesFlag;
+
+    // The address from the last --base option, or -1 if there was none.
+    // Actions that read files remember it when they are parsed, so each
+    // --base applies to the files after it in the same job.
+    int64_t baseAddress;
+};
 
 static Output output;
 
 // These variables store the results from parsing the command-line arguments.
-static std::vector<Action *> actions;
+static Job mainJob;
 static bool showHelpFlag = false;
 static bool listDevicesFlag = false;
 static bool listSupportedFlag = false;
-static bool startBootloaderFlag = false;
 static bool waitForBootloaderFlag = false;
-static bool restartBootloaderFlag = false;
+static uint32_t waitCount = 0;
+static uint32_t waitTimeout = 10;
 static bool pauseFlag = false;
 static bool pauseOnErrorFlag = false;
+static bool allDevicesFlag = false;
+static bool watchFlag = false;
+static bool singleThreadFlag = false;
+static std::string batchFileName;
+static uint32_t maxPerBus = 4;
+static bool dryRunFlag = false;
+static bool statsFlag = false;
+static std::string snapshotDirectory;
+static bool jsonFlag = false;
+static bool readFormatBinary = false;
+static std::string fmiFileName;
+
+// Durations from --timing in microseconds, indexed by PloaderOperation.
+static std::map<int, uint32_t> timingOverrides;
 
 // True if we have printed the name and serial number of the device we are
 // operating on.
 static bool deviceInfoPrinted = false;
 
-// Returns true if we actually want to get to the state where a bootloader is
-// connected to the computer and we have selected it.
-static bool bootloaderHandleNeeded()
-{
-    return startBootloaderFlag ||
-        restartBootloaderFlag ||
-        actions.size() > 0;
-}
-
 // Returns true if some sort of action was specified on the command line.
 static bool someCommandSpecified()
 {
     return showHelpFlag ||
         listDevicesFlag ||
         listSupportedFlag ||
-        startBootloaderFlag ||
         waitForBootloaderFlag ||
-        restartBootloaderFlag ||
-        actions.size() > 0;
+        waitCount > 0 ||
+        !batchFileName.empty() ||
+        !snapshotDirectory.empty() ||
+        !fmiFileName.empty() ||
+        mainJob.bootloaderHandleNeeded();
+}
+
+static void sleepMilliseconds(uint32_t ms)
+{
+#ifdef _MSC_VER
+    Sleep(ms);
+#else
+    usleep(ms * 1000);
+#endif
 }
 
 template<typename T> static void printUsbIdsAndName(const T & item)
@@ -147,22 +245,23 @@ static void printSelectedDeviceInfo(std::string name, std::string serialNumber)
 // Prints a list of bootloaders and apps connected to the computer.
 static void listDevices()
 {
-    auto bootloaderList = selector.listBootloaders();
-    auto appList = selector.listApps();
+    DeviceSelector & selector = mainJob.selector;
+    const auto & bootloaderList = selector.listBootloaders();
+    const auto & appList = selector.listApps();
 
-    for (const PloaderInstance & instance : bootloaderList)
+    for (const PloaderInstance * instance : bootloaderList)
     {
         printListItem(
-            instance.serialNumber,
-            instance.type.name,
-            getStatus(instance));
+            instance->serialNumber,
+            instance->type->name,
+            getStatus(*instance));
     }
 
-    for (const PloaderAppInstance & instance : appList)
+    for (const PloaderAppInstance * instance : appList)
     {
         printListItem(
-            instance.serialNumber,
-            instance.type.name,
+            instance->serialNumber,
+            instance->type->name,
             "App running");
     }
 
@@ -175,12 +274,12 @@ static void listDevices()
 
 static bool launchBootloaderIfNeeded()
 {
-    if (!bootloaderHandleNeeded())
+    if (!mainJob.bootloaderHandleNeeded())
     {
         return false;
     }
 
-    PloaderAppInstance app = selector.selectAppToLaunchBootloader();
+    PloaderAppInstance app = mainJob.selector.selectAppToLaunchBootloader();
     if (!app)
     {
         return false;
@@ -189,7 +288,7 @@ static bool launchBootloaderIfNeeded()
     if (output.shouldPrintInfo() && !deviceInfoPrinted)
     {
         deviceInfoPrinted = true;
-        printSelectedDeviceInfo(app.type.name, app.serialNumber);
+        printSelectedDeviceInfo(app.type->name, app.serialNumber);
     }
 
     app.launchBootloader();
@@ -201,12 +300,12 @@ static bool launchBootloaderIfNeeded()
 
 static PloaderHandle bootloaderHandleOpen()
 {
-    PloaderInstance instance = selector.selectBootloader();
+    PloaderInstance instance = mainJob.selector.selectBootloader();
 
     if (output.shouldPrintInfo() && !deviceInfoPrinted)
     {
         deviceInfoPrinted = true;
-        printSelectedDeviceInfo(instance.type.name, instance.serialNumber);
+        printSelectedDeviceInfo(instance.type->name, instance.serialNumber);
     }
 
     PloaderHandle handle(instance);
@@ -214,43 +313,83 @@ static PloaderHandle bootloaderHandleOpen()
     return handle;
 }
 
-static void waitForBootloader()
+// Returns true if a qualifying bootloader is present.  If we are going to
+// use the bootloader, we ignore bootloaders locked by other p-load processes.
+static bool bootloaderPresent(DeviceSelector & selector)
+{
+    if (listDevicesFlag)
+    {
+        return selector.listBootloaders().size() > 0;
+    }
+    return selector.listUnlockedBootloaders().size() > 0;
+}
+
+// Waits for a bootloader to appear.  The statusOutput
+// argument can be NULL if no messages should be printed.
+static void waitForBootloader(DeviceSelector & selector, Output * statusOutput)
 {
-    auto bootloaderList = selector.listBootloaders();
-    if (bootloaderList.size () > 0)
+    if (bootloaderPresent(selector))
     {
         return;
     }
 
-    output.printInfo("Waiting for bootloader...");
+    if (statusOutput)
+    {
+        statusOutput->printInfo("Waiting for bootloader...");
+    }
 
-    time_t waitStartTime = time(NULL);
+    selector.waitForBootloader(waitTimeout, listDevicesFlag);
+}
 
-    while(1)
+// Returns the number of qualifying apps and bootloaders.  Like
+// bootloaderPresent, this ignores devices locked by other processes unless we
+// are just listing devices.
+static size_t qualifyingDeviceCount(DeviceSelector & selector)
+{
+    if (listDevicesFlag)
     {
-        auto bootloaderList = selector.listBootloaders();
+        return selector.listApps().size() + selector.listBootloaders().size();
+    }
+    return selector.listUnlockedApps().size() +
+        selector.listUnlockedBootloaders().size();
+}
+
+// Waits until at least the specified number of qualifying apps and
+// bootloaders are present, so that a whole fixture of devices can be
+// programmed as soon as the last one is plugged in.
+static void waitForDeviceCount(DeviceSelector & selector, size_t count)
+{
+    time_t waitStartTime = time(NULL);
+    size_t lastFound = SIZE_MAX;
 
-        if (bootloaderList.size() > 0)
+    while (1)
+    {
+        size_t found = qualifyingDeviceCount(selector);
+        if (found >= count)
         {
             return;
         }
 
-        if (difftime(time(NULL), waitStartTime) > 10)
+        if (found != lastFound)
         {
-            throw selector.deviceNotFoundError();
+            lastFound = found;
+            std::ostringstream message;
+            message << "Waiting for devices (" << found << " of " << count
+                << " present)...";
+            output.printInfo(message.str().c_str());
         }
 
-	// Sleep so that we don't take up 100% CPU time.
-#ifdef _MSC_VER
-        Sleep(100);     // 100 ms
-#else
-        usleep(100000); // 100 ms
-#endif
+        if (difftime(time(NULL), waitStartTime) > waitTimeout)
+        {
+            std::ostringstream message;
+            message << "Only " << found << " of the " << count
+                << " qualifying devices were found.";
+            throw ExceptionWithExitCode(PLOAD_ERROR_DEVICE_NOT_FOUND,
+                message.str());
+        }
 
-        // The previous lists of devices we had are now stale because we
-        // delayed.  Clear them.  (This is our way of telling the device
-        // selector that the program is delaying; the function could have been
-        // named something like "handleDelay" just as well.)
+        // Check often so we can start as soon as the last device is ready.
+        sleepMilliseconds(20);
         selector.clearDeviceLists();
     }
 }
@@ -261,6 +400,230 @@ static void restartBootloader(PloaderHandle & handle)
     output.printInfo("Sent command to restart device.");
 }
 
+// Names and descriptions of the bootloader operations, indexed by
+// PloaderOperation.  The names are used in timing models.
+static const char * const operationNames[PLOADER_OP_COUNT] = {
+    "init",
+    "erase",
+    "flash-write",
+    "eeprom-write",
+    "flash-read",
+    "eeprom-read",
+    "restart",
+};
+static const char * const operationDescriptions[PLOADER_OP_COUNT] = {
+    "Initialize",
+    "Erase flash",
+    "Write flash blocks",
+    "Write EEPROM blocks",
+    "Read flash blocks",
+    "Read EEPROM blocks",
+    "Restart",
+};
+
+// Parses a timing model like "init=1,erase=1150" for --timing.
+static void parseTimingModel(const std::string & model)
+{
+    std::istringstream stream(model);
+    std::string item;
+    while (std::getline(stream, item, ','))
+    {
+        size_t equals = item.find('=');
+        std::string name = item.substr(0, equals);
+        int operation = std::find(operationNames, operationNames + PLOADER_OP_COUNT,
+            name) - operationNames;
+
+        char * end = NULL;
+        double ms = -1;
+        if (equals != std::string::npos && equals + 1 < item.size())
+        {
+            ms = strtod(item.c_str() + equals + 1, &end);
+        }
+
+        if (operation == PLOADER_OP_COUNT || end == NULL || *end != 0 ||
+            !(ms >= 0 && ms < 1e6))
+        {
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                "Invalid item in timing model: '" + item + "'.");
+        }
+        timingOverrides[operation] = (uint32_t)(ms * 1000 + 0.5);
+    }
+}
+
+// The operations done on each type of bootloader in this process, for
+// --stats.
+static std::mutex statsMutex;
+static std::map<const PloaderType *, PloaderStats> measuredStats;
+
+static void recordStats(const PloaderHandle & handle)
+{
+    std::lock_guard<std::mutex> lock(statsMutex);
+    measuredStats[handle.type].add(handle.getStats());
+}
+
+static void printStats()
+{
+    std::lock_guard<std::mutex> lock(statsMutex);
+    for (const auto & entry : measuredStats)
+    {
+        const PloaderStats & stats = entry.second;
+        std::cout << "Measured timing for " << entry.first->name << ":" << std::endl;
+
+        std::ostringstream model;
+        model << std::fixed << std::setprecision(2);
+        for (int i = 0; i < PLOADER_OP_COUNT; i++)
+        {
+            if (stats.count[i] == 0) { continue; }
+            double ms = stats.seconds[i] * 1000 / stats.count[i];
+            std::cout << "  " << std::left << std::setw(22) << operationDescriptions[i]
+                << std::right << std::setw(6) << stats.count[i]
+                << std::fixed << std::setprecision(2) << std::setw(12) << ms
+                << " ms each" << std::endl;
+            model << (model.tellp() ? "," : "") << operationNames[i] << "=" << ms;
+        }
+        std::cout << "  Timing model: " << model.str() << std::endl;
+    }
+}
+
+// Makes sure that we will be able to recognize the app of the specified
+// bootloader when it starts running.
+static void ensureAppDetectable(const PloaderType & type)
+{
+    if (type.getMatchingAppTypes().empty())
+    {
+        throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+            std::string("The --wait-app option is not supported for the ") +
+            type.name + " because its app cannot be recognized.");
+    }
+}
+
+// Waits for the app of a bootloader that we just restarted to appear, and
+// returns the number of seconds that took.
+static double waitForApp(const PloaderInstance & bootloader)
+{
+    return AppWaiter(bootloader).wait(waitTimeout);
+}
+
+static std::string appStartedMessage(double seconds)
+{
+    std::ostringstream message;
+    message << "App started after " << std::fixed << std::setprecision(2)
+        << seconds << " s.";
+    return message.str();
+}
+
+/* Holds the memory we have read from a bootloader, so that several reads with
+ * no writes between them only read each memory from the device once.
+ *
+ * For --dry-run, it can also be used without a device: then it counts the
+ * blocks that would be read and pretends the memory is blank. */
+class DeviceMemoryCache
+{
+public:
+    DeviceMemoryCache(PloaderHandle & handle)
+        : handle(&handle), dryRunStats(NULL), ploaderType(handle.type)
+    {
+        clear();
+    }
+
+    DeviceMemoryCache(const PloaderType & type, PloaderStats & dryRunStats)
+        : handle(NULL), dryRunStats(&dryRunStats), ploaderType(&type)
+    {
+        clear();
+    }
+
+    const PloaderType & type() const
+    {
+        return *ploaderType;
+    }
+
+    const MemoryImage & flash()
+    {
+        if (!flashRead)
+        {
+            flashImage.resize(type().appSize);
+            readFromDevice(&flashImage[0], type().appAddress, type().appSize, false);
+            flashRead = true;
+        }
+        return flashImage;
+    }
+
+    const MemoryImage & eeprom()
+    {
+        if (!eepromRead)
+        {
+            eepromImage.resize(type().eepromSize);
+            readFromDevice(&eepromImage[0], type().eepromAddress, type().eepromSize, true);
+            eepromRead = true;
+        }
+        return eepromImage;
+    }
+
+    // Reads part of flash.  If we already read all of it, this just copies
+    // from the cache; otherwise, reading only the requested blocks is faster.
+    void readFlash(uint8_t * buffer, uint32_t startAddress, uint32_t size)
+    {
+        if (flashRead)
+        {
+            memcpy(buffer, &flashImage[startAddress - type().appAddress], size);
+            return;
+        }
+        readFromDevice(buffer, startAddress, size, false);
+    }
+
+    // Just like readFlash, but for EEPROM instead.
+    void readEeprom(uint8_t * buffer, uint32_t startAddress, uint32_t size)
+    {
+        if (eepromRead)
+        {
+            memcpy(buffer, &eepromImage[startAddress - type().eepromAddress], size);
+            return;
+        }
+        readFromDevice(buffer, startAddress, size, true);
+    }
+
+    // Forgets what we read, because the device's memory was changed.
+    void clear()
+    {
+        flashRead = eepromRead = false;
+    }
+
+private:
+    void readFromDevice(uint8_t * buffer, uint32_t startAddress, uint32_t size,
+        bool eeprom)
+    {
+        if (handle && eeprom)
+        {
+            handle->readEeprom(buffer, startAddress, size);
+        }
+        else if (handle)
+        {
+            handle->readFlash(buffer, startAddress, size);
+        }
+        else
+        {
+            // Count the blocks the same way PloaderHandle reads them.
+            uint32_t regionStart = eeprom ? type().eepromAddress : type().appAddress;
+            uint32_t blockSize = eeprom ? PLOADER_EEPROM_BLOCK_SIZE :
+                PLOADER_FLASH_READ_BLOCK_SIZE;
+            uint32_t firstBlock = (startAddress - regionStart) / blockSize;
+            uint32_t endBlock = (startAddress + size - regionStart +
+                blockSize - 1) / blockSize;
+            dryRunStats->count[eeprom ? PLOADER_OP_READ_EEPROM_BLOCK :
+                PLOADER_OP_READ_FLASH_BLOCK] += endBlock - firstBlock;
+            memset(buffer, 0xFF, size);
+        }
+    }
+
+    PloaderHandle * handle;
+    PloaderStats * dryRunStats;
+    const PloaderType * ploaderType;
+    bool flashRead;
+    bool eepromRead;
+    MemoryImage flashImage;
+    MemoryImage eepromImage;
+};
+
 /* Every Action represents a read or write from memory on the bootloader.
  * If any actions are specified by the user, we will attempt to get
  * the device into bootloader mode and open a handle to the bootloader. */
@@ -270,28 +633,86 @@ public:
 
     // Parses arguments and stores anything it will need for later.
     // Does not open any handles to external devices.
-    virtual void parseArguments(ArgReader &) { }
+    virtual void parseArguments(ArgReader &, const Job &) { }
 
-    virtual void readFiles() { }
+    virtual void readFiles(DeviceSelector &) { }
 
     // Raises an exception if this action is not compatible with the selected
     // bootloader.
-    virtual void ensureBootloaderCompatibility(const PloaderHandle &) = 0;
+    virtual void ensureBootloaderCompatibility(const PloaderType &) = 0;
 
     virtual void writeFiles() { }
 
-    // Actually executes the action.
-    virtual void execute(PloaderHandle &) = 0;
+    // Returns false if the action stores results from the device, so it
+    // cannot be used with --all.
+    virtual bool canRunOnAllDevices() const { return true; }
+
+    // Adds the requests for a write or erase to a plan.  Returns false if the
+    // action reads from the device instead, using execute().
+    virtual bool addSteps(const PloaderType &, PloaderPlan &) const { return false; }
+
+    // Actually executes a read action.
+    virtual void execute(DeviceMemoryCache &) { }
 
     virtual ~Action() { }
 };
 
+// Returns true if a file name ends with ".bin", which means the file has raw
+// binary data.  The extension of a compressed file comes before ".gz" or
+// ".zst".
+static bool fileNameIsBinary(std::string fileName)
+{
+    if (compressionFromFileName(fileName) != COMPRESSION_NONE)
+    {
+        fileName.resize(fileName.rfind('.'));
+    }
+    if (fileName.size() < 4) { return false; }
+    std::string extension = fileName.substr(fileName.size() - 4);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    return extension == ".bin";
+}
+
+// Reads a firmware file, or returns the data we already read from it.  Batch
+// jobs and actions that use the same file share one copy of its data.
+// baseAddress is where the data of a binary file starts, or -1 if unknown.
+static std::shared_ptr<const FirmwareData> readFirmwareFile(
+    const std::string & fileName, int64_t baseAddress)
+{
+    static std::map<std::pair<std::string, int64_t>,
+        std::shared_ptr<const FirmwareData>> cache;
+
+    bool binary = fileNameIsBinary(fileName);
+    if (!binary) { baseAddress = -1; }
+
+    std::shared_ptr<const FirmwareData> & entry =
+        cache[std::make_pair(fileName, baseAddress)];
+    if (!entry)
+    {
+        std::shared_ptr<FirmwareData> newData(new FirmwareData());
+        if (binary)
+        {
+            if (baseAddress < 0)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "The --base option must come before binary file " + fileName + ".");
+            }
+            newData->readBinaryFromFile(fileName.c_str(), baseAddress);
+        }
+        else
+        {
+            newData->readFromFile(fileName.c_str());
+        }
+        entry = newData;
+    }
+    return entry;
+}
+
 class ActionWriteMemory : public Action
 {
 public:
-    ActionWriteMemory(MemorySet ms) : fileName(NULL), memorySet(ms) { }
+    ActionWriteMemory(MemorySet ms) : memorySet(ms) { }
 
-    void parseArguments(ArgReader & argReader) override
+    void parseArguments(ArgReader & argReader, const Job & job) override
     {
         const char * arg = argReader.next();
         if (arg == NULL)
@@ -300,29 +721,52 @@ public:
                 std::string("Expected a filename after ") + argReader.last() + ".");
         }
         fileName = arg;
+        baseAddress = job.baseAddress;
     }
 
-    void readFiles() override
+    void readFiles(DeviceSelector & selector) override
     {
-        assert(fileName != NULL);
+        assert(!fileName.empty());
         assert(!data);
-        data.readFromFile(fileName);
-        selector.specifyFirmwareData(data);
+        data = readFirmwareFile(fileName, baseAddress);
+        selector.specifyFirmwareData(*data);
     }
 
-    void ensureBootloaderCompatibility(const PloaderHandle & handle) override
+    void ensureBootloaderCompatibility(const PloaderType & type) override
     {
-        data.ensureBootloaderCompatibility(handle.type, memorySet);
+        data->ensureBootloaderCompatibility(type, memorySet);
     }
 
-    void execute(PloaderHandle & handle) override
+    bool addSteps(const PloaderType & type, PloaderPlan & plan) const override
     {
-        data.writeToBootloader(handle, memorySet);
+        plan.append(data->getWritePlan(type, memorySet));
+        return true;
+    }
+
+    // Combines the data of a later write into this one, for --merge.  Returns
+    // false if the writes are for different memories, so they cannot be
+    // merged.
+    bool merge(const ActionWriteMemory & later)
+    {
+        if (later.memorySet != memorySet) { return false; }
+
+        if (!data->hexData || !later.data->hexData)
+        {
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                "The --merge option only works with HEX and binary files.");
+        }
+
+        std::shared_ptr<FirmwareData> merged(new FirmwareData());
+        merged->hexData = data->hexData;
+        merged->hexData.add(later.data->hexData);
+        data = merged;
+        return true;
     }
 
 private:
-    const char * fileName;
-    FirmwareData data;
+    std::string fileName;
+    int64_t baseAddress;
+    std::shared_ptr<const FirmwareData> data;
     MemorySet memorySet;
 };
 
@@ -331,34 +775,48 @@ class ActionEraseMemory : public Action
 public:
     ActionEraseMemory(MemorySet ms) : memorySet(ms) { }
 
-    void ensureBootloaderCompatibility(const PloaderHandle & handle) override
+    void ensureBootloaderCompatibility(const PloaderType & type) override
     {
-        handle.type.ensureErasing(memorySet);
+        type.ensureErasing(memorySet);
     }
 
-    void execute(PloaderHandle & handle) override
+    bool addSteps(const PloaderType & type, PloaderPlan & plan) const override
     {
-        if (handle.type.memorySetIncludesFlash(memorySet))
+        if (type.memorySetIncludesFlash(memorySet))
         {
-            handle.initialize();
-            handle.eraseFlash();
+            plan.initialize(type);
+            plan.eraseFlash();
         }
 
-        if (handle.type.memorySetIncludesEeprom(memorySet))
+        if (type.memorySetIncludesEeprom(memorySet))
         {
-            handle.eraseEeprom();
+            plan.eraseEeprom(type);
         }
+        return true;
     }
 
     MemorySet memorySet;
 };
 
+// Parses an unsigned number, which can be decimal or hex with a "0x" prefix.
+// Returns false if the string is not a valid number.
+static bool parseNumber(const std::string & str, uint32_t & number)
+{
+    if (str.empty() || str[0] == '-' || str[0] == '+') { return false; }
+    char * end;
+    errno = 0;
+    unsigned long long value = strtoull(str.c_str(), &end, 0);
+    if (*end != 0 || errno || value > 0xFFFFFFFF) { return false; }
+    number = value;
+    return true;
+}
+
 class ActionReadMemory : public Action
 {
 public:
-    ActionReadMemory(MemorySet ms) : fileName(NULL), memorySet(ms) { }
+    ActionReadMemory(MemorySet ms) : memorySet(ms), rangeSpecified(false) { }
 
-    void parseArguments(ArgReader & argReader) override
+    void parseArguments(ArgReader & argReader, const Job &) override
     {
         const char * arg = argReader.next();
         if (arg == NULL)
@@ -367,166 +825,1928 @@ public:
                 std::string("Expected a filename after ") + argReader.last() + ".");
         }
         fileName = arg;
+
+        // Look for an optional address range at the end: FILE@START:LEN.
+        size_t at = fileName.rfind('@');
+        size_t colon = fileName.rfind(':');
+        if (at != std::string::npos && colon != std::string::npos && colon > at &&
+            parseNumber(fileName.substr(at + 1, colon - at - 1), rangeStart) &&
+            parseNumber(fileName.substr(colon + 1), rangeSize))
+        {
+            if (memorySet == MEMORY_SET_ALL)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "An address range can only be used with --read-flash or --read-eeprom.");
+            }
+            if (rangeSize == 0)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "The address range in '" + fileName + "' is empty.");
+            }
+            fileName.resize(at);
+            rangeSpecified = true;
+        }
+    }
+
+    void readFiles(DeviceSelector &) override
+    {
+        // A binary file has no addresses, so it can only hold one memory.
+        if (readFormatBinary && memorySet == MEMORY_SET_ALL)
+        {
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                "Binary files can only be used with --read-flash or --read-eeprom.");
+        }
     }
 
-    void ensureBootloaderCompatibility(const PloaderHandle & handle) override
+    void ensureBootloaderCompatibility(const PloaderType & type) override
     {
-        handle.type.ensureReading(memorySet);
+        type.ensureReading(memorySet);
+
+        if (!rangeSpecified) { return; }
+
+        uint32_t regionStart = type.appAddress;
+        uint32_t regionSize = type.appSize;
+        if (memorySet == MEMORY_SET_EEPROM)
+        {
+            regionStart = type.eepromAddressHexFile;
+            regionSize = type.eepromSize;
+        }
+
+        if (rangeStart < regionStart ||
+            (uint64_t)rangeStart + rangeSize > (uint64_t)regionStart + regionSize)
+        {
+            std::ostringstream message;
+            message << std::hex << std::uppercase << std::setfill('0');
+            message << "The address range for " << fileName << " is outside of "
+                << (memorySet == MEMORY_SET_EEPROM ? "EEPROM" : "flash")
+                << " (0x" << regionStart << " to 0x"
+                << (regionStart + regionSize - 1) << ").";
+            throw std::runtime_error(message.str());
+        }
     }
 
-    void execute(PloaderHandle & handle) override
+    void execute(DeviceMemoryCache & cache) override
     {
-        const PloaderType & type = handle.type;
+        const PloaderType & type = cache.type();
+
+        if (rangeSpecified)
+        {
+            // Read just the requested bytes and store them in a sparse HEX file.
+            MemoryImage data(rangeSize);
+            if (memorySet == MEMORY_SET_FLASH)
+            {
+                cache.readFlash(&data[0], rangeStart, rangeSize);
+            }
+            else
+            {
+                uint32_t address = type.eepromAddress +
+                    (rangeStart - type.eepromAddressHexFile);
+                cache.readEeprom(&data[0], address, rangeSize);
+            }
+            if (readFormatBinary)
+            {
+                binaryData = std::move(data);
+            }
+            else
+            {
+                hexData.setImage(rangeStart, data);
+            }
+            return;
+        }
+
+        // Binary files just get the image, without making HEX records.
+        if (readFormatBinary)
+        {
+            binaryData = memorySet == MEMORY_SET_FLASH ? cache.flash() : cache.eeprom();
+            return;
+        }
 
         // Read from the bootloader's flash if needed.
         if (type.memorySetIncludesFlash(memorySet))
         {
-            MemoryImage flash(type.appSize);
-            handle.readFlash(&flash[0]);
-            hexData.setImage(type.appAddress, flash);
+            hexData.setImage(type.appAddress, cache.flash());
         }
 
         // Read from the bootloader's EEPROM if needed.
         if (type.memorySetIncludesEeprom(memorySet))
         {
-            MemoryImage eeprom(type.eepromSize);
-            handle.readEeprom(&eeprom[0]);
-            hexData.setImage(type.eepromAddressHexFile, eeprom);
+            hexData.setImage(type.eepromAddressHexFile, cache.eeprom());
         }
     }
 
     void writeFiles() override
     {
-        assert(fileName != NULL);
-        assert(hexData);
+        assert(!fileName.empty());
+
+        if (readFormatBinary)
+        {
+            assert(!binaryData.empty());
+            auto filePtr = openFileOrPipeOutput(fileName, true);
+            filePtr->write((const char *)&binaryData[0], binaryData.size());
+            finishOutput(*filePtr, fileName);
+            return;
+        }
 
+        assert(hexData);
         auto filePtr = openFileOrPipeOutput(fileName);
         hexData.writeToFile(*filePtr);
+        finishOutput(*filePtr, fileName);
+    }
+
+    bool canRunOnAllDevices() const override
+    {
+        return false;
     }
 
 private:
-    const char * fileName;
+    std::string fileName;
     IntelHex::Data hexData;
+    MemoryImage binaryData;
     MemorySet memorySet;
-};
 
-void addAction(Action * action, ArgReader & argReader)
-{
-    action->parseArguments(argReader);
-    actions.push_back(action);
-}
+    // An optional range of addresses to read, using the same addresses as the
+    // HEX file.
+    bool rangeSpecified;
+    uint32_t rangeStart;
+    uint32_t rangeSize;
+};
 
-void parseArgs(int argc, char ** argv)
+// Finds the bytes that differ between two buffers and returns them as ranges
+// of offsets, each one a start and a size.  Most of the data usually matches,
+// so we compare it in chunks with memcmp, which is vectorized, and only look
+// at the bytes of chunks that differ.
+static std::vector<std::pair<uint32_t, uint32_t>> findDifferentRanges(
+    const uint8_t * a, const uint8_t * b, uint32_t size)
 {
-    ArgReader argReader(argc, argv);
-
-    while (1)
+    const uint32_t chunkSize = 64;
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+    for (uint32_t chunk = 0; chunk < size; chunk += chunkSize)
     {
-        const char * argCStr = argReader.next();
-
-        if (argCStr == NULL)
-        {
-            break;  // Done reading arguments.
-        }
-
-        std::string arg = argCStr;
+        uint32_t chunkEnd = std::min(chunk + chunkSize, size);
+        if (memcmp(a + chunk, b + chunk, chunkEnd - chunk) == 0) { continue; }
 
-        if (arg == "-t")
+        for (uint32_t i = chunk; i < chunkEnd; i++)
         {
-            const char * s = argReader.next();
-            if (s == NULL)
+            if (a[i] == b[i]) { continue; }
+            if (!ranges.empty() && ranges.back().first + ranges.back().second == i)
             {
-                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
-                    "Expected a device type after '" + std::string(argReader.last()) + "'.");
+                ranges.back().second++;
             }
-            const PloaderUserType * userType = ploaderUserTypeLookup(s);
-            if (userType == NULL)
+            else
             {
-                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
-                    "Invalid device type '" + std::string(s) + "'.");
+                ranges.push_back(std::make_pair(i, 1));
             }
-            selector.specifyUserType(*userType);
         }
-        else if (arg == "-d")
+    }
+    return ranges;
+}
+
+// Returns a string as a JSON string literal.
+static std::string jsonString(const std::string & str)
+{
+    std::ostringstream out;
+    out << '"';
+    for (unsigned char c : str)
+    {
+        if (c == '"' || c == '\\')
         {
-            if (selector.serialNumberWasSpecified())
-            {
-                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
-                    "A serial number can only be specified once.");
-            }
-            const char * s = argReader.next();
-            if (s == NULL)
-            {
-                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
-                    "Expected a serial number after '" + std::string(argReader.last()) + "'.");
-            }
-            if (s[0] == 0)
-            {
-                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
-                    "An empty serial number was specified.");
-            }
-            selector.specifySerialNumber(s);
+            out << '\\' << c;
         }
-        else if (arg == "--list")
+        else if (c < 0x20)
         {
-            listDevicesFlag = true;
+            out << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+                << (int)c << std::dec << std::setfill(' ');
         }
-        else if (arg == "--list-supported")
+        else
         {
-            listSupportedFlag = true;
+            out << c;
         }
-        else if (arg == "--start-bootloader")
-        {
-            startBootloaderFlag = true;
+    }
+    out << '"';
+    return out.str();
+}
+
+// Protects standard output and the results while running several jobs at
+// once with --all or --batch.
+static std::mutex resultsMutex;
+static uint32_t failedJobCount = 0;
+static uint8_t failedJobsExitCode = 0;
+
+/* Compares the memory of the device to what it would be after writing a file
+ * to it, and prints the ranges of addresses that differ.  The device is not
+ * changed.  To predict the memory, we apply the steps of the file's write plan
+ * to a copy of the device's memory, so this works for HEX files and for FMI
+ * files with plain data. */
+class ActionDiffMemory : public Action
+{
+public:
+    void parseArguments(ArgReader & argReader, const Job & job) override
+    {
+        const char * arg = argReader.next();
+        if (arg == NULL)
+        {
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                std::string("Expected a filename after ") + argReader.last() + ".");
+        }
+        fileName = arg;
+        baseAddress = job.baseAddress;
+    }
+
+    void readFiles(DeviceSelector & selector) override
+    {
+        assert(!fileName.empty());
+        data = readFirmwareFile(fileName, baseAddress);
+        selector.specifyFirmwareData(*data);
+    }
+
+    void ensureBootloaderCompatibility(const PloaderType & type) override
+    {
+        data->ensureBootloaderCompatibility(type, MEMORY_SET_ALL);
+
+        for (const PloaderStep & step : data->getWritePlan(type, MEMORY_SET_ALL).steps)
+        {
+            if (step.kind == PloaderStep::INITIALIZE &&
+                step.uploadType != UPLOAD_TYPE_PLAIN)
+            {
+                throw std::runtime_error("The data in " + fileName +
+                    " is not plain, so it cannot be compared to the device.");
+            }
+            if (step.kind == PloaderStep::WRITE_EEPROM_BLOCK)
+            {
+                type.ensureEepromAccess();
+            }
+            else
+            {
+                type.ensureFlashReading();
+            }
+        }
+    }
+
+    void execute(DeviceMemoryCache & cache) override
+    {
+        const PloaderType & type = cache.type();
+        MemoryImage flash, eeprom;
+
+        for (const PloaderStep & step : data->getWritePlan(type, MEMORY_SET_ALL).steps)
+        {
+            switch (step.kind)
+            {
+            case PloaderStep::ERASE_FLASH:
+                flash.assign(type.appSize, 0xFF);
+                break;
+            case PloaderStep::WRITE_FLASH_BLOCK:
+                if (flash.empty()) { flash = cache.flash(); }
+                memcpy(&flash[step.address - type.appAddress], step.data, step.size);
+                break;
+            case PloaderStep::WRITE_EEPROM_BLOCK:
+                if (eeprom.empty()) { eeprom = cache.eeprom(); }
+                memcpy(&eeprom[step.address - type.eepromAddress], step.data, step.size);
+                break;
+            default:
+                break;
+            }
+        }
+
+        regions.clear();
+        if (!flash.empty())
+        {
+            addRegion("flash", type.appAddress, cache.flash(), flash);
+        }
+        if (!eeprom.empty())
+        {
+            addRegion("EEPROM", type.eepromAddressHexFile, cache.eeprom(), eeprom);
+        }
+    }
+
+    // Prints the report.  Jobs in a batch can finish at the same time, so
+    // the report is printed all at once.
+    void writeFiles() override
+    {
+        std::ostringstream report;
+        if (jsonFlag)
+        {
+            printJson(report);
+        }
+        else
+        {
+            printText(report);
+        }
+
+        std::lock_guard<std::mutex> lock(resultsMutex);
+        std::cout << report.str() << std::flush;
+    }
+
+    // Returns true if the last execute() found differences.
+    bool mismatchFound() const
+    {
+        for (const Region & region : regions)
+        {
+            if (region.differentBytes) { return true; }
+        }
+        return false;
+    }
+
+    bool canRunOnAllDevices() const override
+    {
+        return false;
+    }
+
+private:
+    struct Region
+    {
+        const char * name;
+        uint32_t startAddress;
+        uint32_t size;
+        uint32_t differentBytes;
+        std::vector<std::pair<uint32_t, uint32_t>> ranges;
+    };
+
+    void addRegion(const char * name, uint32_t startAddress,
+        const MemoryImage & actual, const MemoryImage & expected)
+    {
+        Region region;
+        region.name = name;
+        region.startAddress = startAddress;
+        region.size = actual.size();
+        region.ranges = findDifferentRanges(&actual[0], &expected[0], actual.size());
+        region.differentBytes = 0;
+        for (auto & range : region.ranges)
+        {
+            range.first += startAddress;
+            region.differentBytes += range.second;
+        }
+        regions.push_back(std::move(region));
+    }
+
+    void printText(std::ostream & out) const
+    {
+        out << "Comparing device to " << fileName << ":" << std::endl;
+        for (const Region & region : regions)
+        {
+            if (region.ranges.empty())
+            {
+                out << "  " << region.name << ": matches" << std::endl;
+                continue;
+            }
+            out << "  " << region.name << ": " << region.differentBytes
+                << " bytes differ in " << region.ranges.size()
+                << (region.ranges.size() == 1 ? " range" : " ranges") << std::endl;
+            for (const auto & range : region.ranges)
+            {
+                out << "    0x" << std::hex << std::uppercase
+                    << std::setfill('0') << std::setw(4) << range.first
+                    << " to 0x" << std::setw(4) << (range.first + range.second - 1)
+                    << std::dec << std::setfill(' ') << " (" << range.second
+                    << (range.second == 1 ? " byte)" : " bytes)") << std::endl;
+            }
+        }
+    }
+
+    void printJson(std::ostream & out) const
+    {
+        out << "{\"file\": " << jsonString(fileName) << ", \"regions\": [";
+        for (size_t i = 0; i < regions.size(); i++)
+        {
+            const Region & region = regions[i];
+            out << (i ? "," : "") << std::endl
+                << "  {\"name\": " << jsonString(region.name)
+                << ", \"start\": " << region.startAddress
+                << ", \"size\": " << region.size
+                << ", \"differentBytes\": " << region.differentBytes
+                << ", \"ranges\": [";
+            for (size_t j = 0; j < region.ranges.size(); j++)
+            {
+                out << (j ? ", " : "") << "{\"start\": "
+                    << region.ranges[j].first << ", \"size\": "
+                    << region.ranges[j].second << "}";
+            }
+            out << "]}";
+        }
+        out << std::endl << "]}" << std::endl;
+    }
+
+    std::string fileName;
+    int64_t baseAddress;
+    std::shared_ptr<const FirmwareData> data;
+    std::vector<Region> regions;
+};
+
+// Raises an exception if a --diff action of the job found that the device
+// does not match the file.  This is done after the rest of the job so that
+// the device still gets restarted.
+static void ensureNoMismatches(const Job & job)
+{
+    for (const Action * action : job.actions)
+    {
+        const ActionDiffMemory * diff = dynamic_cast<const ActionDiffMemory *>(action);
+        if (diff && diff->mismatchFound())
+        {
+            throw ExceptionWithExitCode(PLOAD_ERROR_MEMORY_MISMATCH,
+                "The device's memory does not match the file.");
+        }
+    }
+}
+
+// Returns true if the string looks like a USB port path: a bus number, a dash,
+// and then one or more port numbers separated by dots.
+static bool portPathIsValid(const std::string & str)
+{
+    size_t dash = str.find('-');
+    if (dash == std::string::npos) { return false; }
+
+    bool digitExpected = true;
+    for (size_t i = 0; i < str.size(); i++)
+    {
+        char c = str[i];
+        if (c >= '0' && c <= '9')
+        {
+            digitExpected = false;
+        }
+        else if (digitExpected)
+        {
+            return false;
+        }
+        else if ((c == '-' && i == dash) || (c == '.' && i > dash))
+        {
+            digitExpected = true;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return !digitExpected;
+}
+
+Job::~Job()
+{
+    for (Action * action : actions)
+    {
+        delete action;
+    }
+}
+
+// Records the result of running a job on one device and prints it.  The
+// prefix identifies the job in a batch manifest and is empty for --all.
+static void reportJobResult(const std::string & prefix,
+    const std::string & serialNumber, const std::string & name,
+    uint8_t exitCode, const std::string & message)
+{
+    std::lock_guard<std::mutex> lock(resultsMutex);
+
+    if (exitCode)
+    {
+        // If the jobs failed in different ways, use a general exit code.
+        if (failedJobCount && exitCode != failedJobsExitCode)
+        {
+            failedJobsExitCode = PLOAD_ERROR_OPERATION_FAILED;
+        }
+        else
+        {
+            failedJobsExitCode = exitCode;
+        }
+        failedJobCount++;
+    }
+
+    if (watchFlag)
+    {
+        // p-load runs for a long time in watch mode, so put the time on each
+        // line of the log.
+        char timeString[32];
+        time_t now = time(NULL);
+        strftime(timeString, sizeof(timeString), "%Y-%m-%d %H:%M:%S ",
+            localtime(&now));
+        std::cout << timeString;
+    }
+
+    std::cout << prefix;
+    printListItem(serialNumber, name, message);
+}
+
+// Throws an exception if any of the jobs reported with reportJobResult failed.
+static void ensureNoJobsFailed(size_t jobCount, const char * what)
+{
+    if (failedJobCount)
+    {
+        std::ostringstream message;
+        message << failedJobCount << " of " << jobCount << " " << what << " failed.";
+        throw ExceptionWithExitCode(failedJobsExitCode, message.str());
+    }
+}
+
+/* A job's actions compiled for one type of bootloader.  The writes and erases
+ * between reads are combined into one optimized plan, so we skip the requests
+ * that would not change the final state of the device, like an erase before a
+ * write that erases again.  plans[i] runs before reads[i], and the last plan
+ * runs after the last read. */
+struct CompiledActions
+{
+    std::vector<PloaderPlan> plans;
+    std::vector<Action *> reads;
+};
+
+// Returns the compiled actions of a job for a type of bootloader.  They are
+// compiled once and then shared by all the devices of that type, so each
+// device just replays the plans.  This is safe to call from the scheduler's
+// threads.
+static const CompiledActions & compileActions(const Job & job,
+    const PloaderType & type)
+{
+    static std::mutex mutex;
+    static std::map<std::pair<const Job *, const PloaderType *>,
+        std::unique_ptr<CompiledActions>> cache;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::unique_ptr<CompiledActions> & entry = cache[std::make_pair(&job, &type)];
+    if (!entry)
+    {
+        std::unique_ptr<CompiledActions> compiled(new CompiledActions());
+        compiled->plans.emplace_back();
+        for (Action * action : job.actions)
+        {
+            if (!action->addSteps(type, compiled->plans.back()))
+            {
+                compiled->reads.push_back(action);
+                compiled->plans.emplace_back();
+            }
+        }
+        for (PloaderPlan & plan : compiled->plans)
+        {
+            plan.optimize();
+        }
+        entry = std::move(compiled);
+    }
+    return *entry;
+}
+
+// Runs compiled actions, calling executePlan for each plan that has steps.
+// Reads with no writes between them share the data they read.
+template <typename F>
+static void runCompiledActions(const CompiledActions & compiled,
+    DeviceMemoryCache & cache, F executePlan)
+{
+    for (size_t i = 0; i < compiled.plans.size(); i++)
+    {
+        if (!compiled.plans[i].steps.empty())
+        {
+            executePlan(compiled.plans[i]);
+            cache.clear();
+        }
+
+        if (i < compiled.reads.size())
+        {
+            compiled.reads[i]->execute(cache);
+        }
+    }
+}
+
+// Runs a job's actions on a bootloader.
+static void executeActions(PloaderHandle & handle, const Job & job)
+{
+    DeviceMemoryCache cache(handle);
+    runCompiledActions(compileActions(job, *handle.type), cache,
+        [&](const PloaderPlan & plan) { handle.executePlan(plan); });
+}
+
+// Counts the operations that the main job would do on a type of bootloader,
+// without using a device.
+static PloaderStats countJobOperations(const PloaderType & type)
+{
+    for (Action * action : mainJob.actions)
+    {
+        action->ensureBootloaderCompatibility(type);
+    }
+
+    if (mainJob.waitForAppFlag)
+    {
+        ensureAppDetectable(type);
+    }
+
+    PloaderStats counts;
+    DeviceMemoryCache cache(type, counts);
+    runCompiledActions(compileActions(mainJob, type), cache,
+        [&](const PloaderPlan & plan)
+        {
+            for (const PloaderStep & step : plan.steps)
+            {
+                switch (step.kind)
+                {
+                case PloaderStep::INITIALIZE:
+                    counts.count[PLOADER_OP_INITIALIZE]++;
+                    break;
+                case PloaderStep::ERASE_FLASH:
+                    counts.count[PLOADER_OP_ERASE_FLASH]++;
+                    break;
+                case PloaderStep::WRITE_FLASH_BLOCK:
+                    counts.count[PLOADER_OP_WRITE_FLASH_BLOCK]++;
+                    break;
+                case PloaderStep::WRITE_EEPROM_BLOCK:
+                    counts.count[PLOADER_OP_WRITE_EEPROM_BLOCK]++;
+                    break;
+                case PloaderStep::RESTART:
+                    counts.count[PLOADER_OP_RESTART]++;
+                    break;
+                }
+            }
+        });
+
+    if (mainJob.restartBootloaderFlag)
+    {
+        counts.count[PLOADER_OP_RESTART]++;
+    }
+    return counts;
+}
+
+// Shows the bootloader operations that the main job would do, and predicts
+// how long they would take, for each type of bootloader that we might use.
+// This does not change any devices.
+static void dryRun()
+{
+    std::vector<const PloaderType *> types =
+        mainJob.selector.listPossibleBootloaderTypes();
+    if (types.empty())
+    {
+        throw ExceptionWithExitCode(PLOAD_ERROR_DEVICE_NOT_FOUND,
+            "Cannot tell what type of device would be used.  "
+            "Connect the device or use -t.");
+    }
+
+    bool anyPossible = false;
+    for (const PloaderType * type : types)
+    {
+        std::cout << type->name << ":" << std::endl;
+
+        PloaderStats counts;
+        try
+        {
+            counts = countJobOperations(*type);
+        }
+        catch (const std::exception & error)
+        {
+            std::cout << "  Not possible: " << error.what() << std::endl;
+            continue;
+        }
+        anyPossible = true;
+
+        double seconds = 0;
+        for (int i = 0; i < PLOADER_OP_COUNT; i++)
+        {
+            uint32_t us = type->timing.duration[i];
+            if (timingOverrides.count(i)) { us = timingOverrides[i]; }
+            seconds += counts.count[i] * us / 1e6;
+
+            if (counts.count[i] == 0) { continue; }
+            std::cout << "  " << std::left << std::setw(22) << operationDescriptions[i]
+                << std::right << std::setw(6) << counts.count[i] << std::endl;
+        }
+        std::cout << "  Predicted time: " << std::fixed << std::setprecision(2)
+            << seconds << " s" << std::endl;
+    }
+
+    if (!anyPossible)
+    {
+        throw std::runtime_error(
+            "The actions are not possible on any of the devices that could be used.");
+    }
+}
+
+// Gets one device into bootloader mode, opens it, and calls
+// work(handle, instance), which returns a message to report.  The
+// serialNumber and name arguments are updated as soon as we know which device
+// we are using.  This runs on one of the scheduler's threads, so it must not
+// print progress.
+template <typename F>
+static std::string runOnDevice(Scheduler & scheduler,
+    DeviceSelector & deviceSelector, std::string & serialNumber,
+    std::string & name, F work)
+{
+    PloaderAppInstance app = deviceSelector.selectAppToLaunchBootloader();
+    if (app)
+    {
+        serialNumber = app.serialNumber;
+        name = app.type->name;
+        scheduler.waitToLaunch(app.portPath);
+        Scheduler::TransferSlot slot(scheduler, app.portPath);
+        app.launchBootloader();
+    }
+
+    if (app || waitForBootloaderFlag)
+    {
+        // We do not hold a transfer slot while waiting, so other devices on
+        // the bus can use the time.
+        waitForBootloader(deviceSelector, NULL);
+    }
+
+    PloaderInstance instance = deviceSelector.selectBootloader();
+    serialNumber = instance.serialNumber;
+    name = instance.type->name;
+
+    Scheduler::TransferSlot slot(scheduler, instance.portPath);
+    PloaderHandle handle(instance);
+    return work(handle, instance);
+}
+
+// Runs a job's actions on an open bootloader for runOnDevice.
+static std::string runJobOnBootloader(PloaderHandle & handle,
+    const PloaderInstance & instance, const Job & job)
+{
+    for (Action * action : job.actions)
+    {
+        action->ensureBootloaderCompatibility(*handle.type);
+    }
+
+    if (job.waitForAppFlag)
+    {
+        ensureAppDetectable(*handle.type);
+    }
+
+    executeActions(handle, job);
+
+    for (Action * action : job.actions)
+    {
+        action->writeFiles();
+    }
+
+    if (job.restartBootloaderFlag)
+    {
+        handle.restartDevice();
+    }
+
+    recordStats(handle);
+
+    std::string message = "OK";
+    if (job.waitForAppFlag)
+    {
+        message = appStartedMessage(waitForApp(instance));
+    }
+
+    ensureNoMismatches(job);
+    return message;
+}
+
+// Calls runOnDevice and reports the result, including any error.
+template <typename F>
+static void runOnDeviceAndReport(Scheduler & scheduler,
+    DeviceSelector & deviceSelector, const std::string & prefix,
+    std::string serialNumber, std::string name, F work)
+{
+    try
+    {
+        std::string message = runOnDevice(scheduler, deviceSelector,
+            serialNumber, name, work);
+        reportJobResult(prefix, serialNumber, name, 0, message);
+    }
+    catch (const ExceptionWithExitCode & error)
+    {
+        reportJobResult(prefix, serialNumber, name, error.getCode(),
+            std::string("Error: ") + error.what());
+    }
+    catch (const std::exception & error)
+    {
+        reportJobResult(prefix, serialNumber, name, PLOAD_ERROR_OPERATION_FAILED,
+            std::string("Error: ") + error.what());
+    }
+
+    // A batch job's selector lives as long as the batch, so release its
+    // locks now to let other p-load processes use the device.
+    deviceSelector.releaseDeviceLocks();
+}
+
+// Runs a job on one device and reports the result.
+static void runOnDeviceAndReport(Scheduler & scheduler,
+    DeviceSelector & deviceSelector, const Job & job, const std::string & prefix,
+    std::string serialNumber, std::string name)
+{
+    runOnDeviceAndReport(scheduler, deviceSelector, prefix, serialNumber, name,
+        [&job](PloaderHandle & handle, const PloaderInstance & instance)
+        {
+            return runJobOnBootloader(handle, instance, job);
+        });
+}
+
+// Returns the plan for running a job's actions on a type of bootloader,
+// including the restart.  Plans are made once for each job and type and then
+// shared by all the devices, which only need to remember how far along they
+// are.  This is only used from the executor's thread.
+static const PloaderPlan & getJobPlan(const Job & job, const PloaderType & type)
+{
+    static std::map<std::pair<const Job *, const PloaderType *>,
+        std::unique_ptr<PloaderPlan>> plans;
+
+    std::unique_ptr<PloaderPlan> & plan = plans[std::make_pair(&job, &type)];
+    if (!plan)
+    {
+        // Jobs that read from devices are rejected when the arguments and
+        // the batch manifest are parsed.
+        const CompiledActions & compiled = compileActions(job, type);
+        assert(compiled.reads.empty());
+
+        std::unique_ptr<PloaderPlan> newPlan(new PloaderPlan());
+        newPlan->append(compiled.plans[0]);
+        if (job.restartBootloaderFlag)
+        {
+            newPlan->restartDevice();
+        }
+        plan = std::move(newPlan);
+    }
+    return *plan;
+}
+
+// The next time a bootloader can be launched on each USB controller, for
+// DeviceTask.
+static std::map<std::string, Executor::Clock::time_point> nextLaunchTimes;
+
+/* A DeviceTask does the same thing as runOnDevice, but as a state machine that
+ * does one USB request or device check in each step, so an Executor can run
+ * many of them on one thread. */
+class DeviceTask : public Executor::Task
+{
+public:
+    typedef Executor::Clock Clock;
+
+    // The selector must remain valid until the task is finished.  To give the
+    // task its own selector, pass NULL and specify the serial number or port.
+    DeviceTask(const Job & job, DeviceSelector * selector,
+        const std::string & prefix, const std::string & serialNumber,
+        const std::string & portPath, const std::string & name)
+        : job(job), selector(selector), prefix(prefix),
+          serialNumber(serialNumber), name(name), state(SELECT)
+    {
+        if (selector == NULL)
+        {
+            ownSelector.reset(new DeviceSelector());
+            if (!serialNumber.empty()) { ownSelector->specifySerialNumber(serialNumber); }
+            if (!portPath.empty()) { ownSelector->specifyPortPath(portPath); }
+            this->selector = ownSelector.get();
+        }
+    }
+
+    bool step(Clock::time_point & wakeTime) override
+    {
+        if (runStep(wakeTime)) { return true; }
+
+        // Let other p-load processes use the device now, whether the job
+        // worked or not.
+        runner.reset();
+        handle.close();
+        selector->releaseDeviceLocks();
+
+        if (onFinish) { onFinish(); }
+        return false;
+    }
+
+    // Called when the task is finished, if set.
+    std::function<void()> onFinish;
+
+private:
+    bool runStep(Clock::time_point & wakeTime)
+    {
+        try
+        {
+            return advance(wakeTime);
+        }
+        catch (const ExceptionWithExitCode & error)
+        {
+            reportJobResult(prefix, serialNumber, name, error.getCode(),
+                std::string("Error: ") + error.what());
+        }
+        catch (const std::exception & error)
+        {
+            reportJobResult(prefix, serialNumber, name, PLOAD_ERROR_OPERATION_FAILED,
+                std::string("Error: ") + error.what());
+        }
+        return false;
+    }
+
+    enum State
+    {
+        SELECT,
+        LAUNCH,
+        WAIT_FOR_BOOTLOADER,
+        OPEN,
+        RUN_PLAN,
+        WAIT_FOR_APP,
+    };
+
+    bool advance(Clock::time_point & wakeTime)
+    {
+        switch (state)
+        {
+        case SELECT:
+        {
+            app = selector->selectAppToLaunchBootloader();
+            if (app)
+            {
+                serialNumber = app.serialNumber;
+                name = app.type->name;
+                state = LAUNCH;
+            }
+            else
+            {
+                state = waitForBootloaderFlag ? WAIT_FOR_BOOTLOADER : OPEN;
+            }
+            waitStartTime = Clock::now();
+            return true;
+        }
+
+        case LAUNCH:
+        {
+            // Space out the launches on each controller, like
+            // Scheduler::waitToLaunch.
+            Clock::time_point & next =
+                nextLaunchTimes[Scheduler::controllerName(app.portPath)];
+            if (wakeTime < next)
+            {
+                wakeTime = next;
+                return true;
+            }
+            next = wakeTime + std::chrono::milliseconds(200);
+
+            app.launchBootloader();
+            state = WAIT_FOR_BOOTLOADER;
+            waitStartTime = Clock::now();
+            wakeTime += std::chrono::milliseconds(100);
+            return true;
+        }
+
+        case WAIT_FOR_BOOTLOADER:
+        {
+            selector->clearDeviceLists();
+            if (selector->listUnlockedBootloaders().size() == 0)
+            {
+                if (wakeTime - waitStartTime > std::chrono::seconds(waitTimeout))
+                {
+                    throw selector->deviceNotFoundError();
+                }
+                wakeTime += std::chrono::milliseconds(100);
+                return true;
+            }
+            state = OPEN;
+            return true;
+        }
+
+        case OPEN:
+        {
+            instance = selector->selectBootloader();
+            serialNumber = instance.serialNumber;
+            name = instance.type->name;
+            handle = PloaderHandle(instance);
+
+            for (Action * action : job.actions)
+            {
+                action->ensureBootloaderCompatibility(*handle.type);
+            }
+
+            if (job.waitForAppFlag)
+            {
+                ensureAppDetectable(*handle.type);
+            }
+
+            runner.reset(new PloaderPlanRunner(handle, getJobPlan(job, *handle.type)));
+            state = RUN_PLAN;
+            return true;
+        }
+
+        case RUN_PLAN:
+        {
+            if (runner->step())
+            {
+                return true;
+            }
+            runner.reset();
+
+            recordStats(handle);
+            handle.close();
+            if (job.waitForAppFlag)
+            {
+                state = WAIT_FOR_APP;
+                waitStartTime = Clock::now();
+                appWaiter.reset(new AppWaiter(instance));
+                return true;
+            }
+
+            reportJobResult(prefix, serialNumber, name, 0, "OK");
+            return false;
+        }
+
+        case WAIT_FOR_APP:
+        {
+            if (appWaiter->appIsRunning())
+            {
+                double seconds = std::chrono::duration<double>(
+                    wakeTime - waitStartTime).count();
+                reportJobResult(prefix, serialNumber, name, 0,
+                    appStartedMessage(seconds));
+                return false;
+            }
+
+            if (wakeTime - waitStartTime > std::chrono::seconds(waitTimeout))
+            {
+                throw AppWaiter::timeoutError(waitTimeout);
+            }
+            wakeTime += std::chrono::milliseconds(20);
+            return true;
+        }
+        }
+
+        assert(0);
+        return false;
+    }
+
+    const Job & job;
+    std::unique_ptr<DeviceSelector> ownSelector;
+    DeviceSelector * selector;
+    std::string prefix;
+    std::string serialNumber;
+    std::string name;
+
+    State state;
+    Clock::time_point waitStartTime;
+    PloaderAppInstance app;
+    PloaderInstance instance;
+    PloaderHandle handle;
+    std::unique_ptr<PloaderPlanRunner> runner;
+
+    std::unique_ptr<AppWaiter> appWaiter;
+};
+
+// Calls addDevice(serialNumber, portPath, name) for each qualifying device
+// that is not being used by another p-load process, and returns the number of
+// devices.  Devices that we would not be able to find again are reported as
+// failures instead.
+template <typename F>
+static uint32_t addUnlockedDevices(DeviceSelector & selector, F addDevice)
+{
+    uint32_t deviceCount = 0;
+
+    auto add = [&](const std::string & serialNumber,
+        const std::string & portPath, const std::string & name)
+    {
+        deviceCount++;
+
+        if (serialNumber.empty() && portPath.empty())
+        {
+            reportJobResult("", serialNumber, name, PLOAD_ERROR_OPERATION_FAILED,
+                "Error: The device has no serial number or port path.");
+            return;
+        }
+
+        addDevice(serialNumber, portPath, name);
+    };
+
+    for (const PloaderAppInstance * app : selector.listUnlockedApps())
+    {
+        add(app->serialNumber, app->portPath, app->type->name);
+    }
+    for (const PloaderInstance * bootloader : selector.listUnlockedBootloaders())
+    {
+        add(bootloader->serialNumber, bootloader->portPath,
+            bootloader->type->name);
+    }
+
+    if (deviceCount == 0)
+    {
+        throw selector.deviceNotFoundError();
+    }
+    return deviceCount;
+}
+
+// Restricts a selector to one device that was found earlier.  The device is
+// identified by its port if possible, because the port stays the same when
+// the device restarts.  Both are used if we know them.
+static void specifyDevice(DeviceSelector & selector,
+    const std::string & serialNumber, const std::string & portPath)
+{
+    if (!serialNumber.empty()) { selector.specifySerialNumber(serialNumber); }
+    if (!portPath.empty()) { selector.specifyPortPath(portPath); }
+}
+
+// Runs the actions on every qualifying device that is not being used by
+// another p-load process, several devices at a time.
+static void runOnAllDevices()
+{
+    DeviceSelector & selector = mainJob.selector;
+
+    if (waitForBootloaderFlag && selector.listUnlockedApps().size() == 0)
+    {
+        waitForBootloader(selector, &output);
+    }
+
+    Scheduler scheduler(maxPerBus, 200);
+    Executor executor;
+
+    uint32_t deviceCount = addUnlockedDevices(selector,
+        [&](const std::string & serialNumber, const std::string & portPath,
+            const std::string & name)
+    {
+        if (singleThreadFlag)
+        {
+            executor.add(std::unique_ptr<Executor::Task>(new DeviceTask(
+                mainJob, NULL, "", serialNumber, portPath, name)));
+            return;
+        }
+
+        scheduler.addJob(portPath, [&scheduler, serialNumber, portPath, name]()
+        {
+            DeviceSelector deviceSelector;
+            specifyDevice(deviceSelector, serialNumber, portPath);
+            runOnDeviceAndReport(scheduler, deviceSelector, mainJob, "",
+                serialNumber, name);
+        });
+    });
+
+    scheduler.run();
+    executor.run();
+
+    ensureNoJobsFailed(deviceCount, "devices");
+}
+
+// Reads the memory of every qualifying device at once for --snapshot, and
+// stores the images in a directory where identical images share one file.
+static void snapshotAllDevices()
+{
+    DeviceSelector & selector = mainJob.selector;
+
+    if (waitForBootloaderFlag && selector.listUnlockedApps().size() == 0)
+    {
+        waitForBootloader(selector, &output);
+    }
+
+    SnapshotStore store(snapshotDirectory);
+    Scheduler scheduler(maxPerBus, 200);
+
+    auto work = [&store](PloaderHandle & handle, const PloaderInstance & instance)
+    {
+        if (mainJob.waitForAppFlag)
+        {
+            ensureAppDetectable(*handle.type);
+        }
+
+        std::string message = store.add(handle, instance);
+
+        if (mainJob.restartBootloaderFlag)
+        {
+            handle.restartDevice();
+        }
+
+        recordStats(handle);
+
+        if (mainJob.waitForAppFlag)
+        {
+            message += ", " + appStartedMessage(waitForApp(instance));
+        }
+        return message;
+    };
+
+    uint32_t deviceCount = addUnlockedDevices(selector,
+        [&](const std::string & serialNumber, const std::string & portPath,
+            const std::string & name)
+    {
+        scheduler.addJob(portPath, [&scheduler, work, serialNumber, portPath, name]()
+        {
+            DeviceSelector deviceSelector;
+            specifyDevice(deviceSelector, serialNumber, portPath);
+            runOnDeviceAndReport(scheduler, deviceSelector, "",
+                serialNumber, name, work);
+        });
+    });
+
+    scheduler.run();
+
+    // Devices that failed are left out of the manifest.
+    store.writeManifest();
+
+    ensureNoJobsFailed(deviceCount, "devices");
+}
+
+// A file to put in the FMI file made by --make-fmi, and the devices it is for.
+struct FmiImageSource
+{
+    const PloaderUserType * userType;
+    std::string fileName;
+    int64_t baseAddress;
+};
+
+static std::vector<FmiImageSource> fmiImageSources;
+
+static void makeFirmwareArchive()
+{
+    // Read the files first, then make the images for each type of bootloader
+    // at the same time.
+    std::vector<const PloaderType *> types;
+    std::vector<std::shared_ptr<const FirmwareData>> datas;
+    std::vector<std::string> fileNames;
+    for (const FmiImageSource & source : fmiImageSources)
+    {
+        std::shared_ptr<const FirmwareData> data =
+            readFirmwareFile(source.fileName, source.baseAddress);
+        for (const PloaderType * type : source.userType->getMatchingTypes())
+        {
+            for (const PloaderType * otherType : types)
+            {
+                if (otherType->usbProductId == type->usbProductId)
+                {
+                    throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                        std::string("More than one file is for the ") +
+                        type->name + ".");
+                }
+            }
+            types.push_back(type);
+            datas.push_back(data);
+            fileNames.push_back(source.fileName);
+        }
+    }
+
+    FirmwareArchive::Data archive;
+    archive.images.resize(types.size());
+    std::vector<std::string> errors(types.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < types.size(); i++)
+    {
+        threads.emplace_back([&, i]()
+        {
+            try
+            {
+                archive.images[i] = datas[i]->makeArchiveImage(*types[i]);
+            }
+            catch (const std::exception & e)
+            {
+                errors[i] = fileNames[i] + ": " + types[i]->name + ": " + e.what();
+            }
+        });
+    }
+    for (std::thread & thread : threads)
+    {
+        thread.join();
+    }
+    for (const std::string & error : errors)
+    {
+        if (!error.empty()) { throw std::runtime_error(error); }
+    }
+
+    auto filePtr = openFileOrPipeOutput(fmiFileName);
+    archive.writeToFile(*filePtr);
+    finishOutput(*filePtr, fmiFileName);
+
+    for (size_t i = 0; i < types.size(); i++)
+    {
+        std::string message = std::string(types[i]->name) + ": " +
+            std::to_string(archive.images[i].blocks.size()) + " blocks";
+        output.printInfo(message.c_str());
+    }
+}
+
+// A device that watch mode has seen.
+struct WatchedDevice
+{
+    WatchedDevice() : busy(false), lastSeenTime(0) { }
+
+    // True while a job for the device is running.
+    std::atomic<bool> busy;
+
+    // When the device was last seen.  Jobs set this when they finish, from
+    // their own threads.
+    std::atomic<time_t> lastSeenTime;
+};
+
+// A device stays in the list of watched devices this long after it is no
+// longer seen, so a device that is restarting is not treated as a new one.
+#define WATCH_FORGET_TIME 3
+
+// Runs forever, doing the actions on each qualifying device that gets
+// connected.  A device is handled once, and is handled again only after it
+// has been gone for WATCH_FORGET_TIME seconds after its job finished.  Devices are identified by serial number, or by USB
+// port if they have no serial number.
+static void watchForDevices()
+{
+    DeviceSelector & selector = mainJob.selector;
+    Scheduler scheduler(maxPerBus, 200);
+    Executor executor;
+    std::map<std::string, WatchedDevice> watchedDevices;
+
+    output.printInfo("Waiting for devices...  Press Ctrl+C to stop.");
+
+    auto keyFor = [](const std::string & serialNumber, const std::string & portPath)
+    {
+        return serialNumber.empty() ? "port " + portPath : serialNumber;
+    };
+
+    // Notes that a device we already know about is still connected, even if
+    // it is locked by one of our jobs.
+    auto refresh = [&](const std::string & serialNumber, const std::string & portPath)
+    {
+        auto it = watchedDevices.find(keyFor(serialNumber, portPath));
+        if (it != watchedDevices.end()) { it->second.lastSeenTime = time(NULL); }
+    };
+
+    auto see = [&](const std::string & serialNumber,
+        const std::string & portPath, const std::string & name)
+    {
+        std::string key = keyFor(serialNumber, portPath);
+        if (serialNumber.empty() && portPath.empty()) { return; }
+
+        bool isNew = !watchedDevices.count(key);
+        WatchedDevice & device = watchedDevices[key];
+        device.lastSeenTime = time(NULL);
+        if (!isNew) { return; }
+
+        device.busy = true;
+        WatchedDevice * devicePtr = &device;
+
+        if (singleThreadFlag)
+        {
+            DeviceTask * task = new DeviceTask(mainJob, NULL, "",
+                serialNumber, portPath, name);
+            task->onFinish = [devicePtr]()
+            {
+                devicePtr->lastSeenTime = time(NULL);
+                devicePtr->busy = false;
+            };
+            executor.add(std::unique_ptr<Executor::Task>(task));
+            return;
+        }
+
+        scheduler.startJob([&scheduler, serialNumber, portPath, name, devicePtr]()
+        {
+            DeviceSelector deviceSelector;
+            specifyDevice(deviceSelector, serialNumber, portPath);
+
+            runOnDeviceAndReport(scheduler, deviceSelector, mainJob, "",
+                serialNumber, name);
+            devicePtr->lastSeenTime = time(NULL);
+            devicePtr->busy = false;
+        });
+    };
+
+    while (1)
+    {
+        for (const PloaderAppInstance * app : selector.listApps())
+        {
+            refresh(app->serialNumber, app->portPath);
+        }
+        for (const PloaderInstance * bootloader : selector.listBootloaders())
+        {
+            refresh(bootloader->serialNumber, bootloader->portPath);
+        }
+
+        // Only start jobs for devices that no other process has locked.
+        for (const PloaderAppInstance * app : selector.listUnlockedApps())
+        {
+            see(app->serialNumber, app->portPath, app->type->name);
+        }
+        for (const PloaderInstance * bootloader : selector.listUnlockedBootloaders())
+        {
+            see(bootloader->serialNumber, bootloader->portPath,
+                bootloader->type->name);
+        }
+
+        // A device whose job is running counts as seen, so the time it must
+        // be gone before we forget it starts when the job finishes.
+        time_t now = time(NULL);
+        for (auto it = watchedDevices.begin(); it != watchedDevices.end(); )
+        {
+            if (it->second.busy)
+            {
+                it->second.lastSeenTime = now;
+                ++it;
+            }
+            else if (difftime(now, it->second.lastSeenTime) > WATCH_FORGET_TIME)
+            {
+                it = watchedDevices.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+
+        scheduler.joinStartedJobs(false);
+
+        // Run the single-threaded jobs, if any, while we wait to check for
+        // new devices.
+        executor.runUntil(Executor::Clock::now() + std::chrono::milliseconds(100));
+        if (executor.size() == 0)
+        {
+            sleepMilliseconds(100);
+        }
+        selector.clearDeviceLists();
+    }
+}
+
+// For --merge, replaces each run of writes to the same memory with one write
+// of the combined data.  This must be called after the files are read.
+static void mergeWriteActions(Job & job)
+{
+    if (!job.mergeWritesFlag) { return; }
+
+    std::vector<Action *> actions;
+    for (Action * action : job.actions)
+    {
+        ActionWriteMemory * write = dynamic_cast<ActionWriteMemory *>(action);
+        ActionWriteMemory * previous = actions.empty() ? NULL :
+            dynamic_cast<ActionWriteMemory *>(actions.back());
+        if (write && previous && previous->merge(*write))
+        {
+            delete action;
+            continue;
+        }
+        actions.push_back(action);
+    }
+    job.actions = actions;
+}
+
+// Returns true if any of the job's actions read from the device, which is not
+// supported when running on all devices or on the executor.
+static bool jobReadsFromDevice(const Job & job)
+{
+    for (const Action * action : job.actions)
+    {
+        if (!action->canRunOnAllDevices()) { return true; }
+    }
+    return false;
+}
+
+static void addAction(Job & job, Action * action, ArgReader & argReader)
+{
+    action->parseArguments(argReader, job);
+    job.actions.push_back(action);
+}
+
+// Parses the arguments that select a device and say what to do with it, which
+// can be used on the command line or in a batch manifest.  Returns false if
+// the argument is not one of those.
+static bool parseJobArg(const std::string & arg, ArgReader & argReader, Job & job)
+{
+    DeviceSelector & selector = job.selector;
+
+    if (arg == "-t")
+    {
+        const char * s = argReader.next();
+        if (s == NULL)
+        {
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                "Expected a device type after '" + std::string(argReader.last()) + "'.");
+        }
+        const PloaderUserType * userType = ploaderUserTypeLookup(s);
+        if (userType == NULL)
+        {
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                "Invalid device type '" + std::string(s) + "'.");
+        }
+        selector.specifyUserType(*userType);
+    }
+    else if (arg == "-d")
+    {
+        if (selector.serialNumberWasSpecified())
+        {
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                "A serial number can only be specified once.");
+        }
+        const char * s = argReader.next();
+        if (s == NULL)
+        {
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                "Expected a serial number after '" + std::string(argReader.last()) + "'.");
+        }
+        if (s[0] == 0)
+        {
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                "An empty serial number was specified.");
+        }
+        selector.specifySerialNumber(s);
+    }
+    else if (arg == "-p")
+    {
+        if (selector.portPathWasSpecified())
+        {
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                "A USB port can only be specified once.");
+        }
+        const char * s = argReader.next();
+        if (s == NULL)
+        {
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                "Expected a USB port after '" + std::string(argReader.last()) + "'.");
+        }
+        if (!portPathIsValid(s))
+        {
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                "Invalid USB port '" + std::string(s) + "'.  "
+                "Expected something like 1-2.3.");
+        }
+#ifndef __linux__
+        throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+            "Specifying a USB port is only supported on Linux.");
+#endif
+        selector.specifyPortPath(s);
+    }
+    else if (arg == "--start-bootloader")
+    {
+        job.startBootloaderFlag = true;
+    }
+    else if (arg == "-w")
+    {
+        addAction(job, new ActionWriteMemory(MEMORY_SET_ALL), argReader);
+        job.restartBootloaderFlag = true;
+    }
+    else if (arg == "--write")
+    {
+        addAction(job, new ActionWriteMemory(MEMORY_SET_ALL), argReader);
+    }
+    else if (arg == "--write-flash")
+    {
+        addAction(job, new ActionWriteMemory(MEMORY_SET_FLASH), argReader);
+    }
+    else if (arg == "--write-eeprom")
+    {
+        addAction(job, new ActionWriteMemory(MEMORY_SET_EEPROM), argReader);
+    }
+    else if (arg == "--erase")
+    {
+        addAction(job, new ActionEraseMemory(MEMORY_SET_ALL), argReader);
+    }
+    else if (arg == "--erase-flash")
+    {
+        addAction(job, new ActionEraseMemory(MEMORY_SET_FLASH), argReader);
+    }
+    else if (arg == "--erase-eeprom")
+    {
+        addAction(job, new ActionEraseMemory(MEMORY_SET_EEPROM), argReader);
+    }
+    else if (arg == "--read")
+    {
+        addAction(job, new ActionReadMemory(MEMORY_SET_ALL), argReader);
+    }
+    else if (arg == "--read-flash")
+    {
+        addAction(job, new ActionReadMemory(MEMORY_SET_FLASH), argReader);
+    }
+    else if (arg == "--read-eeprom")
+    {
+        addAction(job, new ActionReadMemory(MEMORY_SET_EEPROM), argReader);
+    }
+    else if (arg == "--diff")
+    {
+        addAction(job, new ActionDiffMemory(), argReader);
+    }
+    else if (arg == "--merge")
+    {
+        job.mergeWritesFlag = true;
+    }
+    else if (arg == "--base")
+    {
+        const char * s = argReader.next();
+        uint32_t address;
+        if (s == NULL || !parseNumber(s, address))
+        {
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                "Expected an address after '" + std::string(argReader.last()) + "'.");
+        }
+        job.baseAddress = address;
+    }
+    else if (arg == "--restart")
+    {
+        job.restartBootloaderFlag = true;
+    }
+    else if (arg == "--wait-app")
+    {
+        job.restartBootloaderFlag = true;
+        job.waitForAppFlag = true;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+// Splits a line of a batch manifest into words.  Words are separated by
+// spaces, and double quotes can be used around words that contain spaces.
+static std::vector<std::string> splitManifestLine(const std::string & line)
+{
+    std::vector<std::string> words;
+    std::string word;
+    bool inWord = false;
+    bool inQuotes = false;
+    for (char c : line)
+    {
+        if (c == '"')
+        {
+            inQuotes = !inQuotes;
+            inWord = true;
+        }
+        else if (!inQuotes && (c == ' ' || c == '\t' || c == '\r'))
+        {
+            if (inWord) { words.push_back(word); }
+            word.clear();
+            inWord = false;
+        }
+        else
+        {
+            word += c;
+            inWord = true;
+        }
+    }
+    if (inQuotes)
+    {
+        throw std::runtime_error("Unterminated quotation mark.");
+    }
+    if (inWord) { words.push_back(word); }
+    return words;
+}
+
+// A job from a batch manifest, along with the manifest line it came from.
+struct BatchJob
+{
+    std::string label;
+    Job job;
+};
+
+// Reads a batch manifest.  Each line that is not blank or a comment starting
+// with '#' has the options for one job, e.g. "-d 12345678 -w app.hex".
+static std::vector<std::unique_ptr<BatchJob>> readBatchManifest(
+    const std::string & fileName)
+{
+    std::vector<std::unique_ptr<BatchJob>> jobs;
+    auto file = openFileOrPipeInput(fileName);
+
+    std::string line;
+    uint32_t lineNumber = 0;
+    while (std::getline(*file, line))
+    {
+        lineNumber++;
+
+        std::unique_ptr<BatchJob> batchJob(new BatchJob());
+        batchJob->label = fileName + ":" + std::to_string(lineNumber);
+
+        try
+        {
+            std::vector<std::string> words = splitManifestLine(line);
+            if (words.empty() || words[0][0] == '#') { continue; }
+
+            // ArgReader skips the first argument, like a program name.
+            std::vector<char *> argv(1, NULL);
+            for (std::string & word : words)
+            {
+                argv.push_back(&word[0]);
+            }
+            ArgReader argReader(argv.size() - 1, &argv[0]);
+
+            while (const char * arg = argReader.next())
+            {
+                if (!parseJobArg(arg, argReader, batchJob->job))
+                {
+                    throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                        std::string("Invalid option in batch manifest: '") + arg + "'.");
+                }
+            }
+
+            if (!batchJob->job.bootloaderHandleNeeded())
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "The line does not specify anything to do.");
+            }
+
+            if (singleThreadFlag && jobReadsFromDevice(batchJob->job))
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "Reading from devices is not supported with --single-thread.");
+            }
+
+            for (Action * action : batchJob->job.actions)
+            {
+                action->readFiles(batchJob->job.selector);
+            }
+            mergeWriteActions(batchJob->job);
+        }
+        catch (const ExceptionWithExitCode & error)
+        {
+            throw ExceptionWithExitCode(error.getCode(),
+                batchJob->label + ": " + error.what());
+        }
+        catch (const std::exception & error)
+        {
+            throw std::runtime_error(batchJob->label + ": " + error.what());
+        }
+
+        jobs.push_back(std::move(batchJob));
+    }
+
+    if (jobs.empty())
+    {
+        throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+            "The batch manifest " + fileName + " has no jobs.");
+    }
+
+    return jobs;
+}
+
+// Returns the USB port path of the device that a job will probably use, so
+// the scheduler can put the job with the other jobs on the same bus.
+static std::string guessPortPath(DeviceSelector & selector)
+{
+    std::string portPath;
+    if (selector.listUnlockedApps().size() > 0)
+    {
+        portPath = selector.listUnlockedApps()[0]->portPath;
+    }
+    else if (selector.listUnlockedBootloaders().size() > 0)
+    {
+        portPath = selector.listUnlockedBootloaders()[0]->portPath;
+    }
+    selector.clearDeviceLists();
+    return portPath;
+}
+
+// Runs all the jobs from a batch manifest, several at a time.  The jobs share
+// the firmware files they use and the enumerations of USB devices.
+static void runBatch(const std::string & fileName)
+{
+    std::vector<std::unique_ptr<BatchJob>> jobs = readBatchManifest(fileName);
+
+    Scheduler scheduler(maxPerBus, 200);
+    Executor executor;
+    for (const std::unique_ptr<BatchJob> & batchJob : jobs)
+    {
+        BatchJob & b = *batchJob;
+
+        if (singleThreadFlag)
+        {
+            executor.add(std::unique_ptr<Executor::Task>(new DeviceTask(
+                b.job, &b.job.selector, b.label + ": ", "", "", "")));
+            continue;
+        }
+
+        scheduler.addJob(guessPortPath(b.job.selector), [&scheduler, &b]()
+        {
+            runOnDeviceAndReport(scheduler, b.job.selector, b.job,
+                b.label + ": ", "", "");
+        });
+    }
+
+    scheduler.run();
+    executor.run();
+
+    ensureNoJobsFailed(jobs.size(), "jobs");
+}
+
+static void parseArgs(int argc, char ** argv)
+{
+    ArgReader argReader(argc, argv);
+
+    while (1)
+    {
+        const char * argCStr = argReader.next();
+
+        if (argCStr == NULL)
+        {
+            break;  // Done reading arguments.
+        }
+
+        std::string arg = argCStr;
+
+        if (parseJobArg(arg, argReader, mainJob))
+        {
+            // The argument was for the main job.
+        }
+        else if (arg == "--list")
+        {
+            listDevicesFlag = true;
+        }
+        else if (arg == "--list-supported")
+        {
+            listSupportedFlag = true;
         }
         else if (arg == "--wait")
         {
             waitForBootloaderFlag = true;
         }
-        else if (arg == "-w")
+        else if (arg == "--wait-count")
+        {
+            const char * s = argReader.next();
+            if (s == NULL || !parseNumber(s, waitCount) || waitCount == 0)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "Expected a positive number after '" + std::string(argReader.last()) + "'.");
+            }
+        }
+        else if (arg == "--timeout")
         {
-            addAction(new ActionWriteMemory(MEMORY_SET_ALL), argReader);
-            restartBootloaderFlag = true;
+            const char * s = argReader.next();
+            if (s == NULL || !parseNumber(s, waitTimeout))
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "Expected a number of seconds after '" + std::string(argReader.last()) + "'.");
+            }
+        }
+        else if (arg == "--all")
+        {
+            allDevicesFlag = true;
+        }
+        else if (arg == "--watch")
+        {
+            watchFlag = true;
         }
-        else if (arg == "--write")
+        else if (arg == "--single-thread")
         {
-            addAction(new ActionWriteMemory(MEMORY_SET_ALL), argReader);
+            singleThreadFlag = true;
         }
-        else if (arg == "--write-flash")
+        else if (arg == "--batch")
         {
-            addAction(new ActionWriteMemory(MEMORY_SET_FLASH), argReader);
+            const char * s = argReader.next();
+            if (s == NULL)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    std::string("Expected a filename after ") + argReader.last() + ".");
+            }
+            batchFileName = s;
+        }
+        else if (arg == "--max-per-bus")
+        {
+            const char * s = argReader.next();
+            if (s == NULL || !parseNumber(s, maxPerBus) || maxPerBus == 0)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "Expected a positive number after '" + std::string(argReader.last()) + "'.");
+            }
         }
-        else if (arg == "--write-eeprom")
+        else if (arg == "--dry-run")
         {
-            addAction(new ActionWriteMemory(MEMORY_SET_EEPROM), argReader);
+            dryRunFlag = true;
         }
-        else if (arg == "--erase")
+        else if (arg == "--timing")
         {
-            addAction(new ActionEraseMemory(MEMORY_SET_ALL), argReader);
+            const char * s = argReader.next();
+            if (s == NULL)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "Expected a timing model after '" + std::string(argReader.last()) + "'.");
+            }
+            parseTimingModel(s);
         }
-        else if (arg == "--erase-flash")
+        else if (arg == "--stats")
         {
-            addAction(new ActionEraseMemory(MEMORY_SET_FLASH), argReader);
+            statsFlag = true;
         }
-        else if (arg == "--erase-eeprom")
+        else if (arg == "--json")
         {
-            addAction(new ActionEraseMemory(MEMORY_SET_EEPROM), argReader);
+            jsonFlag = true;
         }
-        else if (arg == "--read")
+        else if (arg == "--read-format")
         {
-            addAction(new ActionReadMemory(MEMORY_SET_ALL), argReader);
+            const char * s = argReader.next();
+            if (s == NULL || (strcmp(s, "hex") && strcmp(s, "bin")))
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "Expected hex or bin after '" + std::string(argReader.last()) + "'.");
+            }
+            readFormatBinary = !strcmp(s, "bin");
         }
-        else if (arg == "--read-flash")
+        else if (arg == "--snapshot")
         {
-            addAction(new ActionReadMemory(MEMORY_SET_FLASH), argReader);
+            const char * s = argReader.next();
+            if (s == NULL)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    std::string("Expected a directory after ") + argReader.last() + ".");
+            }
+            snapshotDirectory = s;
         }
-        else if (arg == "--read-eeprom")
+        else if (arg == "--make-fmi")
         {
-            addAction(new ActionReadMemory(MEMORY_SET_EEPROM), argReader);
+            const char * s = argReader.next();
+            if (s == NULL)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    std::string("Expected a filename after ") + argReader.last() + ".");
+            }
+            fmiFileName = s;
         }
-        else if (arg == "--restart")
+        else if (arg == "--fmi-image")
         {
-            restartBootloaderFlag = true;
+            const char * typeName = argReader.next();
+            if (typeName == NULL)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "Expected a device type after '" + std::string(argReader.last()) + "'.");
+            }
+            FmiImageSource source;
+            source.userType = ploaderUserTypeLookup(typeName);
+            if (source.userType == NULL)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "Invalid device type '" + std::string(typeName) + "'.");
+            }
+            const char * s = argReader.next();
+            if (s == NULL)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    std::string("Expected a filename after ") + typeName + ".");
+            }
+            source.fileName = s;
+            source.baseAddress = mainJob.baseAddress;
+            fmiImageSources.push_back(source);
         }
         else if (arg == "--pause")
         {
@@ -552,12 +2772,93 @@ void parseArgs(int argc, char ** argv)
         throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
             "Arguments do not specify anything to do.");
     }
+
+    if ((allDevicesFlag || watchFlag) && jobReadsFromDevice(mainJob))
+    {
+        throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+            "Reading from devices is not supported with --all or --watch.");
+    }
+
+    if (watchFlag && !mainJob.bootloaderHandleNeeded())
+    {
+        throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+            "The --watch option requires an action.");
+    }
+
+    if (watchFlag && (allDevicesFlag || listDevicesFlag || !batchFileName.empty()))
+    {
+        throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+            "The --watch option cannot be used with --all, --list, or --batch.");
+    }
+
+    if (dryRunFlag && !mainJob.bootloaderHandleNeeded())
+    {
+        throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+            "The --dry-run option requires an action.");
+    }
+
+    if (jsonFlag && !batchFileName.empty())
+    {
+        throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+            "The --json option cannot be used with --batch because the job\n"
+            "results are printed along with the reports.");
+    }
+
+    if (dryRunFlag && (watchFlag || !batchFileName.empty()))
+    {
+        throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+            "The --dry-run option cannot be used with --watch or --batch.");
+    }
+
+    if (!snapshotDirectory.empty() && (mainJob.actions.size() ||
+        mainJob.startBootloaderFlag))
+    {
+        throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+            "The --snapshot option cannot be used with other actions.");
+    }
+
+    if (!snapshotDirectory.empty() && (watchFlag || listDevicesFlag ||
+        dryRunFlag || singleThreadFlag || !batchFileName.empty()))
+    {
+        throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+            "The --snapshot option cannot be used with --watch, --list, "
+            "--dry-run, --single-thread, or --batch.");
+    }
+
+    if (!fmiFileName.empty() && fmiImageSources.empty())
+    {
+        throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+            "The --make-fmi option requires at least one --fmi-image option.");
+    }
+
+    if (fmiFileName.empty() && !fmiImageSources.empty())
+    {
+        throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+            "The --fmi-image option requires --make-fmi.");
+    }
+
+    if (!fmiFileName.empty() && (mainJob.bootloaderHandleNeeded() ||
+        !snapshotDirectory.empty() || !batchFileName.empty() ||
+        listDevicesFlag || watchFlag || dryRunFlag))
+    {
+        throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+            "The --make-fmi option cannot be used with devices or other actions.");
+    }
+
+    if (!batchFileName.empty() &&
+        (allDevicesFlag || mainJob.bootloaderHandleNeeded()))
+    {
+        throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+            "Actions must be in the batch manifest when --batch is used.");
+    }
 }
 
 static void run(int argc, char ** argv)
 {
     parseArgs(argc, argv);
 
+    DeviceSelector & selector = mainJob.selector;
+
     if (showHelpFlag)
     {
         std::cout << help;
@@ -566,9 +2867,13 @@ static void run(int argc, char ** argv)
 
     if (listDevicesFlag)
     {
+        if (waitCount)
+        {
+            waitForDeviceCount(selector, waitCount);
+        }
         if (waitForBootloaderFlag)
         {
-            waitForBootloader();
+            waitForBootloader(selector, &output);
         }
         listDevices();
         return;
@@ -580,41 +2885,108 @@ static void run(int argc, char ** argv)
         return;
     }
 
-    for (Action * action : actions)
+    if (!fmiFileName.empty())
+    {
+        makeFirmwareArchive();
+        return;
+    }
+
+    if (!batchFileName.empty())
+    {
+        if (waitCount)
+        {
+            waitForDeviceCount(selector, waitCount);
+        }
+        runBatch(batchFileName);
+        return;
+    }
+
+    for (Action * action : mainJob.actions)
     {
-        action->readFiles();
+        action->readFiles(selector);
+    }
+    mergeWriteActions(mainJob);
+
+    if (dryRunFlag)
+    {
+        dryRun();
+        return;
+    }
+
+    if (waitCount)
+    {
+        waitForDeviceCount(selector, waitCount);
+        selector.clearDeviceLists();
+    }
+
+    if (!snapshotDirectory.empty())
+    {
+        snapshotAllDevices();
+        return;
+    }
+
+    if (watchFlag)
+    {
+        watchForDevices();
+        return;
+    }
+
+    if (allDevicesFlag && mainJob.bootloaderHandleNeeded())
+    {
+        runOnAllDevices();
+        return;
     }
 
     bool launchedBootloader = launchBootloaderIfNeeded();
 
     if (launchedBootloader || waitForBootloaderFlag)
     {
-        waitForBootloader();
+        waitForBootloader(selector, &output);
     }
 
-    if (bootloaderHandleNeeded())
+    if (mainJob.bootloaderHandleNeeded())
     {
         PloaderHandle handle = bootloaderHandleOpen();
 
-        for (Action * action : actions)
+        for (Action * action : mainJob.actions)
         {
-            action->ensureBootloaderCompatibility(handle);
+            action->ensureBootloaderCompatibility(*handle.type);
         }
 
-        for (Action * action : actions)
+        if (mainJob.waitForAppFlag)
         {
-            action->execute(handle);
+            ensureAppDetectable(*handle.type);
         }
 
-        for (Action * action : actions)
+        executeActions(handle, mainJob);
+
+        for (Action * action : mainJob.actions)
         {
             action->writeFiles();
         }
 
-        if (restartBootloaderFlag)
+        if (mainJob.restartBootloaderFlag)
         {
             restartBootloader(handle);
         }
+
+        recordStats(handle);
+
+        if (mainJob.restartBootloaderFlag)
+        {
+            // The device is running its app now, so other p-load processes
+            // are welcome to use it.
+            selector.releaseDeviceLocks();
+
+            if (mainJob.waitForAppFlag)
+            {
+                output.printInfo("Waiting for app...");
+                double seconds = waitForApp(selector.selectBootloader());
+                std::cout << appStartedMessage(seconds) << std::endl;
+            }
+        }
+
+        ensureNoMismatches(mainJob);
     }
 }
 
@@ -652,12 +3024,11 @@ int main(int argc, char ** argv)
         exitCode = PLOAD_ERROR_OPERATION_FAILED;
     }
 
-    // Free the memory for the actions.
-    for (Action * action : actions)
+    if (statsFlag)
     {
-        delete action;
+        output.startNewLine();
+        printStats();
     }
-    actions.clear();
 
     if (pauseFlag || (pauseOnErrorFlag && exitCode))
     {
@@ -39,6 +39,13 @@
 #include <iomanip>
 #include <fstream>
 #include <sstream>
+#include <mutex>
+#include <atomic>
+#include <map>
+#include <chrono>
+#include <algorithm>
+#include <iterator>
+#include <thread>
 
 #include <libusbp.hpp>
 
@@ -46,11 +53,17 @@
 #include "exit_codes.h"
 #include "output.h"
 #include "arg_reader.h"
+#include "blank_scan.h"
 #include "ploader.h"
 #include "device_selector.h"
 #include "intel_hex.h"
 #include "firmware_archive.h"
 #include "firmware_data.h"
 #include "file_utils.h"
+#include "compression.h"
+#include "session.h"
+#include "scheduler.h"
+#include "executor.h"
+#include "snapshot.h"
 
 typedef std::vector<uint8_t> MemoryImage;
@@ -3,6 +3,7 @@
  * possible between the different bootloaders. */
 
 #include "p-load.h"
+#include <algorithm>
 
 // Request codes used to talk to the bootloader.
 #define REQUEST_INITIALIZE         0x80
@@ -53,29 +54,18 @@ static std::string ploaderGetErrorDescription(uint8_t errorCode)
     }
 }
 
-const PloaderAppType * ploaderAppTypeLookup(uint16_t usbVendorId, uint16_t usbProductId)
+// An error reported by the bootloader, with the code it reported, so that
+// executePlan can recover from some errors.
+class PloaderRequestError : public std::runtime_error
 {
-    for (const PloaderAppType & t : ploaderAppTypes)
+public:
+    PloaderRequestError(const std::string & message, uint8_t code)
+        : std::runtime_error(message), code(code)
     {
-        if (t.usbVendorId == usbVendorId && t.usbProductId == usbProductId)
-        {
-            return &t;
-        }
     }
-    return NULL;
-}
 
-const PloaderType * ploaderTypeLookup(uint16_t usbVendorId, uint16_t usbProductId)
-{
-    for (const PloaderType & t : ploaderTypes)
-    {
-        if (t.usbVendorId == usbVendorId && t.usbProductId == usbProductId)
-        {
-            return &t;
-        }
-    }
-    return NULL;
-}
+    uint8_t code;
+};
 
 const PloaderUserType * ploaderUserTypeLookup(std::string codeName)
 {
@@ -89,40 +79,39 @@ const PloaderUserType * ploaderUserTypeLookup(std::string codeName)
     return NULL;
 }
 
-template <typename T>
-static std::vector<T> fetchByIds(
-    std::vector<T> items, const std::vector<uint32_t> & ids)
+template <typename T, size_t N>
+static std::vector<const T *> fetchByIds(const T * (*lookup)(uint32_t),
+    const uint32_t (&ids)[N])
 {
-    std::vector<T> r;
+    std::vector<const T *> r;
 
     for (uint32_t id : ids)
     {
-        for (const T & item : items)
+        if (id == 0) { break; }
+
+        const T * item = lookup(id);
+        if (item != NULL)
         {
-            if (item.id == id)
-            {
-                r.push_back(item);
-                break;
-            }
+            r.push_back(item);
         }
     }
 
     return r;
 }
 
-std::vector<PloaderAppType> PloaderType::getMatchingAppTypes() const
+std::vector<const PloaderAppType *> PloaderType::getMatchingAppTypes() const
 {
-    return fetchByIds(ploaderAppTypes, matchingAppTypes);
+    return fetchByIds(ploaderAppTypeLookupById, matchingAppTypes);
 }
 
-std::vector<PloaderAppType> PloaderUserType::getMatchingAppTypes() const
+std::vector<const PloaderAppType *> PloaderUserType::getMatchingAppTypes() const
 {
-    return fetchByIds(ploaderAppTypes, memberIds);
+    return fetchByIds(ploaderAppTypeLookupById, memberIds);
 }
 
-std::vector<PloaderType> PloaderUserType::getMatchingTypes() const
+std::vector<const PloaderType *> PloaderUserType::getMatchingTypes() const
 {
-    return fetchByIds(ploaderTypes, memberIds);
+    return fetchByIds(ploaderTypeLookupById, memberIds);
 }
 
 bool PloaderType::memorySetIncludesFlash(MemorySet ms) const
@@ -205,6 +194,63 @@ void PloaderType::ensureFlashPlainWriting() const
     }
 }
 
+// On Linux, libusbp gives us the sysfs path of the device as its OS ID, and
+// the last component of that path is exactly the port path.  On other systems
+// we return an empty string.
+static std::string getPortPath(const std::string & osId)
+{
+#ifdef __linux__
+    size_t slash = osId.rfind('/');
+    std::string name = osId.substr(slash == std::string::npos ? 0 : slash + 1);
+    if (name.empty() || name.find('-') == std::string::npos) { return ""; }
+    for (char c : name)
+    {
+        if ((c < '0' || c > '9') && c != '-' && c != '.') { return ""; }
+    }
+    return name;
+#else
+    (void)osId;
+    return "";
+#endif
+}
+
+std::string ploaderGetPortPath(const libusbp::device & device)
+{
+    return getPortPath(device.get_os_id());
+}
+
+PloaderAppInstance ploaderGetApp(const libusbp::device & device)
+{
+    // Filter out things that are not known apps.
+    const PloaderAppType * type = ploaderAppTypeLookup(device.get_vendor_id(),
+        device.get_product_id());
+    if (!type) { return PloaderAppInstance(); }
+
+    // Get the generic interface object.
+    libusbp::generic_interface usb_interface;
+    try
+    {
+        usb_interface = libusbp::generic_interface(device,
+            type->interfaceNumber, type->composite);
+    }
+    catch(const libusbp::error & error)
+    {
+        if (error.has_code(LIBUSBP_ERROR_NOT_READY))
+        {
+            // This interface is not ready to be used yet.
+            // This is normal if it was recently enumerated.
+            return PloaderAppInstance();
+        }
+        throw;
+    }
+
+    PloaderAppInstance instance(*type, std::move(usb_interface),
+        device.get_serial_number());
+    instance.osId = device.get_os_id();
+    instance.portPath = getPortPath(instance.osId);
+    return instance;
+}
+
 std::vector<PloaderAppInstance> ploaderListApps()
 {
     // Get a list of all connected USB devices.
@@ -214,31 +260,11 @@ std::vector<PloaderAppInstance> ploaderListApps()
 
     for (const libusbp::device & device : devices)
     {
-        // Filter out things that are not known apps.
-        const PloaderAppType * type = ploaderAppTypeLookup(device.get_vendor_id(),
-            device.get_product_id());
-        if (!type) { continue; }
-
-        // Get the generic interface object.
-        libusbp::generic_interface usb_interface;
-        try
+        PloaderAppInstance instance = ploaderGetApp(device);
+        if (instance)
         {
-            usb_interface = libusbp::generic_interface(device,
-                type->interfaceNumber, type->composite);
+            list.push_back(std::move(instance));
         }
-        catch(const libusbp::error & error)
-        {
-            if (error.has_code(LIBUSBP_ERROR_NOT_READY))
-            {
-                // This interface is not ready to be used yet.
-                // This is normal if it was recently enumerated.
-                continue;
-            }
-            throw;
-        }
-
-        PloaderAppInstance instance(*type, usb_interface, device.get_serial_number());
-        list.push_back(instance);
     }
 
     return list;
@@ -258,6 +284,37 @@ void PloaderAppInstance::launchBootloader()
     }
 }
 
+PloaderInstance ploaderGetBootloader(const libusbp::device & device)
+{
+    // Filter out things that are not bootloaders.
+    const PloaderType * type = ploaderTypeLookup(device.get_vendor_id(),
+        device.get_product_id());
+    if (!type) { return PloaderInstance(); }
+
+    // Get the generic interface object for interface 0.
+    libusbp::generic_interface usb_interface;
+    try
+    {
+        usb_interface = libusbp::generic_interface(device);
+    }
+    catch(const libusbp::error & error)
+    {
+        if (error.has_code(LIBUSBP_ERROR_NOT_READY))
+        {
+            // This interface is not ready to be used yet.
+            // This is normal if it was recently enumerated.
+            return PloaderInstance();
+        }
+        throw;
+    }
+
+    PloaderInstance instance(*type, std::move(usb_interface),
+        device.get_serial_number());
+    instance.osId = device.get_os_id();
+    instance.portPath = getPortPath(instance.osId);
+    return instance;
+}
+
 std::vector<PloaderInstance> ploaderListBootloaders()
 {
     // Get a list of all connected USB devices.
@@ -267,36 +324,18 @@ std::vector<PloaderInstance> ploaderListBootloaders()
 
     for (const libusbp::device & device : devices)
     {
-        // Filter out things that are not bootloaders.
-        const PloaderType * type = ploaderTypeLookup(device.get_vendor_id(),
-            device.get_product_id());
-        if (!type) { continue; }
-
-        // Get the generic interface object for interface 0.
-        libusbp::generic_interface usb_interface;
-        try
+        PloaderInstance instance = ploaderGetBootloader(device);
+        if (instance)
         {
-            usb_interface = libusbp::generic_interface(device);
+            list.push_back(std::move(instance));
         }
-        catch(const libusbp::error & error)
-        {
-            if (error.has_code(LIBUSBP_ERROR_NOT_READY))
-            {
-                // This interface is not ready to be used yet.
-                // This is normal if it was recently enumerated.
-                continue;
-            }
-            throw;
-        }
-
-        PloaderInstance instance(*type, usb_interface, device.get_serial_number());
-        list.push_back(instance);
     }
 
     return list;
 }
 
-PloaderHandle::PloaderHandle(PloaderInstance instance) : type(instance.type)
+PloaderHandle::PloaderHandle(const PloaderInstance & instance)
+    : type(instance.type), listener(NULL)
 {
     handle = libusbp::generic_handle(instance.usbInterface);
 }
@@ -334,7 +373,20 @@ void PloaderHandle::reportError(const libusbp::error & error, std::string contex
     }
 
     std::string message = context + ": " + ploaderGetErrorDescription(errorCode);
-    throw std::runtime_error(message);
+    throw PloaderRequestError(message, errorCode);
+}
+
+// Copies the part of a block read from the device that overlaps with the
+// range of addresses from startAddress to endAddress into the buffer, which
+// holds the data for that range.
+static void copyOverlap(uint8_t * buffer, uint32_t startAddress,
+    uint32_t endAddress, const uint8_t * block, uint32_t blockAddress,
+    uint32_t blockSize)
+{
+    uint32_t start = std::max(startAddress, blockAddress);
+    uint32_t end = std::min(endAddress, blockAddress + blockSize);
+    if (start >= end) { return; }
+    memcpy(buffer + (start - startAddress), block + (start - blockAddress), end - start);
 }
 
 static std::runtime_error transfer_length_error(std::string context,
@@ -346,15 +398,28 @@ static std::runtime_error transfer_length_error(std::string context,
       "got " + std::to_string(actual) + ".");
 }
 
+void PloaderHandle::recordOperation(PloaderOperation operation,
+    std::chrono::steady_clock::time_point startTime, bool done)
+{
+    stats.seconds[operation] += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - startTime).count();
+    if (done)
+    {
+        stats.count[operation]++;
+    }
+}
+
 void PloaderHandle::initialize(uint16_t uploadType)
 {
-    if (type.deviceCode != NULL)
+    auto startTime = std::chrono::steady_clock::now();
+
+    if (type->deviceCode != NULL)
     {
         // The device code might be stored in read-only memory, which can cause
         // WinUSB to give error code 0x3e6 when we try to send it over USB.
         // Copy it to the stack.
         uint8_t b[DEVICE_CODE_SIZE];
-        memcpy(b, type.deviceCode, DEVICE_CODE_SIZE);
+        memcpy(b, type->deviceCode, DEVICE_CODE_SIZE);
 
         try
         {
@@ -379,12 +444,14 @@ void PloaderHandle::initialize(uint16_t uploadType)
             std::string("Failed to initialize bootloader: ") +
             error.message());
     }
+
+    recordOperation(PLOADER_OP_INITIALIZE, startTime);
 }
 
 void PloaderHandle::initialize()
 {
     uint16_t defaultUploadType;
-    if (type.supportsFlashPlainWriting)
+    if (type->supportsFlashPlainWriting)
     {
         defaultUploadType = UPLOAD_TYPE_PLAIN;
     }
@@ -396,27 +463,38 @@ void PloaderHandle::initialize()
     initialize(defaultUploadType);
 }
 
+// Sends one erase request, which erases part of the flash, and returns the
+// number of erase requests that are still needed.
+uint8_t PloaderHandle::eraseFlashRequest()
+{
+    auto startTime = std::chrono::steady_clock::now();
+
+    uint8_t response[2];
+    size_t transferred;
+    handle.control_transfer(0xC0, REQUEST_ERASE_FLASH, 0, 0,
+        &response, sizeof(response), &transferred);
+    if (transferred != 2)
+    {
+        throw transfer_length_error("erasing flash", 2, transferred);
+    }
+    uint8_t errorCode = response[0];
+    if (errorCode)
+    {
+        throw std::runtime_error("Error erasing page: " +
+            ploaderGetErrorDescription(errorCode) + ".");
+    }
+
+    recordOperation(PLOADER_OP_ERASE_FLASH, startTime, response[1] == 0);
+    return response[1];
+}
+
 void PloaderHandle::eraseFlash()
 {
     int maxProgress = 0;
 
     while (true)
     {
-        uint8_t response[2];
-        size_t transferred;
-        handle.control_transfer(0xC0, REQUEST_ERASE_FLASH, 0, 0,
-            &response, sizeof(response), &transferred);
-        if (transferred != 2)
-        {
-            throw transfer_length_error("erasing flash", 2, transferred);
-        }
-        uint8_t errorCode = response[0];
-        uint8_t progressLeft = response[1];
-        if (errorCode)
-        {
-            throw std::runtime_error("Error erasing page: " +
-                ploaderGetErrorDescription(errorCode) + ".");
-        }
+        uint8_t progressLeft = eraseFlashRequest();
 
         if (maxProgress < progressLeft)
         {
@@ -438,12 +516,14 @@ void PloaderHandle::eraseFlash()
 
 void PloaderHandle::writeFlashBlock(uint32_t address, const uint8_t * data, size_t size)
 {
+    auto startTime = std::chrono::steady_clock::now();
+
     size_t transferred;
     try
     {
         handle.control_transfer(0x40, REQUEST_WRITE_FLASH_BLOCK,
             address & 0xFFFF, address >> 16 & 0xFFFF,
-            (uint8_t *)data, type.writeBlockSize, &transferred);
+            (uint8_t *)data, type->writeBlockSize, &transferred);
     }
     catch(const libusbp::error & error)
     {
@@ -453,105 +533,82 @@ void PloaderHandle::writeFlashBlock(uint32_t address, const uint8_t * data, size
     if (transferred != size)
     {
         throw transfer_length_error("writing flash",
-            type.writeBlockSize, transferred);
+            type->writeBlockSize, transferred);
     }
+
+    recordOperation(PLOADER_OP_WRITE_FLASH_BLOCK, startTime);
 }
 
 void PloaderHandle::writeFlash(const uint8_t * image)
 {
     assert(image != NULL);
 
-    const char * message = "Writing flash...";
-
-    type.ensureFlashPlainWriting();
-
-    uint32_t address = type.appAddress + type.appSize;
-    while (address > type.appAddress)
-    {
-        // Advance to the next block.
-        address -= type.writeBlockSize;
-        assert((address % type.writeBlockSize) == 0);
-        const uint8_t * block = &image[address - type.appAddress];
-
-        // If the block is empty, don't write to it.
-        bool blockIsEmpty = true;
-        for (uint32_t i = 0; i < type.writeBlockSize; i++)
-        {
-            if (block[i] != 0xFF)
-            {
-                blockIsEmpty = false;
-                break;
-            }
-        }
-        if (blockIsEmpty)
-        {
-            continue;
-        }
-
-        // Write the block to flash.
-        writeFlashBlock(address, block, type.writeBlockSize);
-
-        if (listener)
-        {
-            // These progress numbers aren't very good because they don't
-            // account for how many blocks actually need to be written to flash.
-            uint32_t progress = type.appSize - (address - type.appAddress);
-            listener->setStatus(message, progress, type.appSize);
-        }
-    }
-
-    // Make sure we report that writing to flash is done.  The loop above
-    // would not do that if the last few blocks are empty.
-    if (listener)
-    {
-      listener->setStatus(message, type.appSize, type.appSize);
-    }
+    PloaderPlan plan;
+    plan.writeFlash(*type, image);
+    executePlan(plan);
 }
 
 void PloaderHandle::readFlash(uint8_t * image)
 {
-    assert(image != NULL);
-    type.ensureFlashReading();
+    readFlash(image, type->appAddress, type->appSize);
+}
+
+void PloaderHandle::readFlash(uint8_t * buffer, uint32_t startAddress, uint32_t size)
+{
+    assert(buffer != NULL);
+    type->ensureFlashReading();
 
-    const uint32_t endAddress = type.appAddress + type.appSize;
+    assert(startAddress >= type->appAddress);
+    assert(startAddress + size <= type->appAddress + type->appSize);
 
-    const size_t blockSize = 1024;
-    uint32_t address = type.appAddress;
-    while(address < endAddress)
+    const uint32_t endAddress = startAddress + size;
+
+    // Start at the beginning of the read block that contains startAddress.
+    const uint32_t blockSize = PLOADER_FLASH_READ_BLOCK_SIZE;
+    uint32_t address = startAddress - (startAddress - type->appAddress) % blockSize;
+    while (address < endAddress)
     {
-        assert(address + blockSize <= endAddress);
+        assert(address + blockSize <= type->appAddress + type->appSize);
+
+        auto startTime = std::chrono::steady_clock::now();
 
+        uint8_t block[PLOADER_FLASH_READ_BLOCK_SIZE];
         size_t transferred;
         handle.control_transfer(0xC0, REQUEST_READ_FLASH,
             address & 0xFFFF, address >> 16 & 0xFFFF,
-            &image[address - type.appAddress], blockSize, &transferred);
+            block, blockSize, &transferred);
         if (transferred != blockSize)
         {
             throw transfer_length_error("reading flash", blockSize, transferred);
         }
 
+        recordOperation(PLOADER_OP_READ_FLASH_BLOCK, startTime);
+
+        copyOverlap(buffer, startAddress, endAddress, block, address, blockSize);
+
         address += blockSize;
 
         if (listener)
         {
             listener->setStatus("Reading flash...",
-                address - type.appAddress, type.appSize);
+                std::min(address, endAddress) - startAddress, size);
         }
     }
 }
 
 void PloaderHandle::eraseEeprom()
 {
-    type.ensureEepromAccess();
-
-    MemoryImage image(type.eepromSize, 0xFF);
-    writeEeprom(&image[0]);
+    PloaderPlan plan;
+    plan.eraseEeprom(*type);
+    executePlan(plan);
 }
 
 void PloaderHandle::writeEepromBlock(uint32_t address,
     const uint8_t * data, size_t size)
 {
-    type.ensureEepromAccess();
+    type->ensureEepromAccess();
+
+    auto startTime = std::chrono::steady_clock::now();
 
     size_t transferred;
     try
@@ -568,83 +625,371 @@ void PloaderHandle::writeEepromBlock(uint32_t address,
     {
         throw transfer_length_error("writing EEPROM", size, transferred);
     }
+
+    recordOperation(PLOADER_OP_WRITE_EEPROM_BLOCK, startTime);
 }
 
-void PloaderHandle::eraseEepromFirstByte()
+void PloaderHandle::writeEeprom(const uint8_t * image)
 {
-    type.ensureEepromAccess();
+    PloaderPlan plan;
+    plan.writeEeprom(*type, image);
+    executePlan(plan);
+}
 
-    uint8_t blankByte = 0xFF;
-    writeEepromBlock(0, &blankByte, 1);
+void PloaderHandle::readEeprom(uint8_t * image)
+{
+    readEeprom(image, type->eepromAddress, type->eepromSize);
 }
 
-void PloaderHandle::writeEeprom(const uint8_t * image)
+void PloaderHandle::readEeprom(uint8_t * buffer, uint32_t startAddress, uint32_t size)
 {
-    type.ensureEepromAccess();
+    assert(buffer != NULL);
+    type->ensureEepromAccess();
+
+    assert(startAddress >= type->eepromAddress);
+    assert(startAddress + size <= type->eepromAddress + type->eepromSize);
 
-    const uint32_t endAddress = type.eepromAddress + type.eepromSize;
+    const uint32_t endAddress = startAddress + size;
 
-    // Set the message to "Erasing EEPROM..." if the image happens to be all 0xFF.
-    // This is less surprising for people who were not intentionally trying to
-    // put anything in EEPROM using software that calls this function to erase it.
-    const char * message = "Erasing EEPROM...";
-    for (uint32_t i = 0; i < type.eepromSize; i++)
+    const uint32_t blockSize = PLOADER_EEPROM_BLOCK_SIZE;
+    uint32_t address = startAddress - (startAddress - type->eepromAddress) % blockSize;
+    while (address < endAddress)
     {
-        if (image[i] != 0xFF)
+        assert(address + blockSize <= type->eepromAddress + type->eepromSize);
+
+        auto startTime = std::chrono::steady_clock::now();
+
+        uint8_t block[PLOADER_EEPROM_BLOCK_SIZE];
+        size_t transferred;
+        handle.control_transfer(0xC0, REQUEST_READ_EEPROM,
+            address & 0xFFFF, address >> 16 & 0xFFFF,
+            block, blockSize, &transferred);
+        if (transferred != blockSize)
         {
-            message = "Writing EEPROM...";
-            break;
+            throw transfer_length_error("reading EEPROM", blockSize, transferred);
         }
-    }
 
-    const uint32_t blockSize = 32;
-    uint32_t address = type.eepromAddress;
-    while (address < endAddress)
-    {
-        assert(address + blockSize <= endAddress);
+        recordOperation(PLOADER_OP_READ_EEPROM_BLOCK, startTime);
+
+        copyOverlap(buffer, startAddress, endAddress, block, address, blockSize);
 
-        writeEepromBlock(address, image + address, blockSize);
         address += blockSize;
+
         if (listener)
         {
-            uint32_t progress = address - type.eepromAddress;
-            listener->setStatus(message, progress, type.eepromSize);
+            listener->setStatus("Reading EEPROM...",
+                std::min(address, endAddress) - startAddress, size);
         }
     }
 }
 
-void PloaderHandle::readEeprom(uint8_t * image)
+void PloaderHandle::applyImage(const FirmwareArchive::Image & image)
 {
-    type.ensureEepromAccess();
+    PloaderPlan plan;
+    plan.applyImage(*type, image);
+    executePlan(plan);
+}
 
-    const uint32_t endAddress = type.eepromAddress + type.eepromSize;
+void PloaderHandle::restartDevice()
+{
+    auto startTime = std::chrono::steady_clock::now();
 
-    uint32_t address = type.eepromAddress;
-    while (address < endAddress)
+    const uint16_t durationMs = 100;
+    try
+    {
+        handle.control_transfer(0x40, REQUEST_RESTART, durationMs, 0);
+    }
+    catch(const libusbp::error & error)
+    {
+        throw std::runtime_error(
+            std::string("Failed to restart device.") + error.what());
+    }
+
+    recordOperation(PLOADER_OP_RESTART, startTime);
+}
+
+bool PloaderHandle::executeStep(const PloaderStep & step)
+{
+    switch (step.kind)
     {
-        const uint32_t blockSize = 32;
-        assert(address + blockSize <= endAddress);
+    case PloaderStep::INITIALIZE:
+        initialize(step.uploadType);
+        return true;
 
-        size_t transferred;
-        handle.control_transfer(0xC0, REQUEST_READ_EEPROM,
-            address & 0xFFFF, address >> 16 & 0xFFFF,
-            &image[address], blockSize, &transferred);
-        if (transferred != blockSize)
+    case PloaderStep::ERASE_FLASH:
+        return eraseFlashRequest() == 0;
+
+    case PloaderStep::WRITE_FLASH_BLOCK:
+        writeFlashBlock(step.address, step.data, step.size);
+        return true;
+
+    case PloaderStep::WRITE_EEPROM_BLOCK:
+        writeEepromBlock(step.address, step.data, step.size);
+        return true;
+
+    case PloaderStep::RESTART:
+        restartDevice();
+        return true;
+    }
+
+    assert(0);
+    return true;
+}
+
+bool PloaderHandle::flashIsBlank()
+{
+    if (!type->supportsFlashReading || checkApplication())
+    {
+        return false;
+    }
+
+    std::vector<uint8_t> image(type->appSize);
+    readFlash(&image[0]);
+    if (!memoryIsBlank(&image[0], image.size()))
+    {
+        return false;
+    }
+
+    if (type->erasingFlashAffectsEeprom && type->supportsEepromAccess)
+    {
+        image.resize(type->eepromSize);
+        readEeprom(&image[0]);
+        if (!memoryIsBlank(&image[0], image.size()))
         {
-            throw transfer_length_error("reading EEPROM", blockSize, transferred);
+            return false;
         }
+    }
 
-        address += blockSize;
+    return true;
+}
 
+void PloaderHandle::executePlan(const PloaderPlan & plan)
+{
+    PloaderPlanRunner runner(*this, plan);
+    while (runner.step()) { }
+}
+
+PloaderPlanRunner::PloaderPlanRunner(PloaderHandle & handle,
+    const PloaderPlan & plan)
+    : handle(&handle), plan(&plan), index(0), erasing(false),
+      maxEraseProgress(0), eraseSkipped(false), skippedEraseIndex(0),
+      eraseRequired(false), runStart(0), runEnd(0), runMessage(NULL)
+{
+}
+
+// Finds the run of writes to the same memory that starts at index.
+void PloaderPlanRunner::startWriteRun()
+{
+    const std::vector<PloaderStep> & steps = plan->steps;
+    PloaderStep::Kind kind = steps[index].kind;
+
+    runStart = index;
+    runEnd = index;
+    bool blank = true;
+    while (runEnd < steps.size() && steps[runEnd].kind == kind)
+    {
+        if (blank && !memoryIsBlank(steps[runEnd].data, steps[runEnd].size))
+        {
+            blank = false;
+        }
+        runEnd++;
+    }
+
+    // Say "Erasing EEPROM..." if we are just writing 0xFF to EEPROM.
+    // This is less surprising for people who were not intentionally
+    // trying to put anything in EEPROM.
+    runMessage = "Writing flash...";
+    if (kind == PloaderStep::WRITE_EEPROM_BLOCK)
+    {
+        runMessage = blank ? "Erasing EEPROM..." : "Writing EEPROM...";
+    }
+}
+
+bool PloaderPlanRunner::step()
+{
+    const std::vector<PloaderStep> & steps = plan->steps;
+    if (index >= steps.size()) { return false; }
+
+    const PloaderStep & step = steps[index];
+    PloaderStatusListener * listener = handle->listener;
+
+    if (step.kind == PloaderStep::ERASE_FLASH)
+    {
+        if (!erasing)
+        {
+            // Devices fresh from the factory are already blank, and reading
+            // the flash to confirm that is much faster than erasing it.
+            if (!eraseRequired && handle->flashIsBlank())
+            {
+                eraseSkipped = true;
+                skippedEraseIndex = index;
+                index++;
+                return true;
+            }
+            erasing = true;
+            maxEraseProgress = 0;
+        }
+
+        uint8_t progressLeft = handle->eraseFlashRequest();
+        if (maxEraseProgress < progressLeft)
+        {
+            maxEraseProgress = progressLeft + 1;
+        }
         if (listener)
         {
-            uint32_t progress = address - type.eepromAddress;
-            listener->setStatus("Reading EEPROM...", progress, endAddress);
+            listener->setStatus("Erasing flash...",
+                maxEraseProgress - progressLeft, maxEraseProgress);
         }
+        if (progressLeft == 0)
+        {
+            erasing = false;
+            index++;
+        }
+        return true;
+    }
+
+    if (step.kind != PloaderStep::WRITE_FLASH_BLOCK &&
+        step.kind != PloaderStep::WRITE_EEPROM_BLOCK)
+    {
+        handle->executeStep(step);
+        index++;
+        return true;
+    }
+
+    if (index < runStart || index >= runEnd)
+    {
+        startWriteRun();
+    }
+
+    try
+    {
+        handle->executeStep(step);
+    }
+    catch (const PloaderRequestError & error)
+    {
+        // The bootloader might only accept writes after an erase.
+        if (!eraseSkipped || error.code != PLOADER_ERROR_STATE)
+        {
+            throw;
+        }
+
+        // Go back to the initialization before the erase we skipped, so
+        // the bootloader is in the state it expects for an erase, and do
+        // everything from there again, this time with the erase.  Erasing
+        // flash might have erased EEPROM too, so any EEPROM writes we
+        // already did after the erase step get done again.
+        index = skippedEraseIndex;
+        while (index > 0 && steps[index].kind != PloaderStep::INITIALIZE) { index--; }
+        if (steps[index].kind != PloaderStep::INITIALIZE) { index = skippedEraseIndex; }
+        eraseSkipped = false;
+        eraseRequired = true;
+        runStart = runEnd = 0;
+        return true;
+    }
+
+    if (step.kind == PloaderStep::WRITE_FLASH_BLOCK)
+    {
+        eraseSkipped = false;
+    }
+
+    if (listener)
+    {
+        listener->setStatus(runMessage, index - runStart + 1, runEnd - runStart);
     }
+    index++;
+    return true;
 }
 
-void PloaderHandle::applyImage(const FirmwareArchive::Image & image)
+void PloaderPlan::initialize(uint16_t uploadType)
+{
+    PloaderStep step = PloaderStep();
+    step.kind = PloaderStep::INITIALIZE;
+    step.uploadType = uploadType;
+    steps.push_back(step);
+}
+
+void PloaderPlan::initialize(const PloaderType & type)
+{
+    initialize(type.supportsFlashPlainWriting ?
+        UPLOAD_TYPE_PLAIN : UPLOAD_TYPE_STANDARD);
+}
+
+void PloaderPlan::eraseFlash()
+{
+    PloaderStep step = PloaderStep();
+    step.kind = PloaderStep::ERASE_FLASH;
+    steps.push_back(step);
+}
+
+void PloaderPlan::restartDevice()
+{
+    PloaderStep step = PloaderStep();
+    step.kind = PloaderStep::RESTART;
+    steps.push_back(step);
+}
+
+void PloaderPlan::append(const PloaderPlan & other)
+{
+    steps.insert(steps.end(), other.steps.begin(), other.steps.end());
+}
+
+void PloaderPlan::addWrite(PloaderStep::Kind kind, uint32_t address,
+    const uint8_t * data, uint32_t size)
+{
+    PloaderStep step = PloaderStep();
+    step.kind = kind;
+    step.address = address;
+    step.data = data;
+    step.size = size;
+    steps.push_back(step);
+}
+
+const uint8_t * PloaderPlan::copy(const uint8_t * data, size_t size)
+{
+    buffers.emplace_back(data, data + size);
+    return &buffers.back()[0];
+}
+
+void PloaderPlan::writeFlash(const PloaderType & type, const uint8_t * image)
+{
+    type.ensureFlashPlainWriting();
+
+    image = copy(image, type.appSize);
+
+    // Write the blocks in descending order and skip the empty ones.
+    std::vector<bool> nonBlank = findNonBlankBlocks(image, type.appSize,
+        type.writeBlockSize);
+    for (size_t i = nonBlank.size(); i-- > 0; )
+    {
+        if (!nonBlank[i]) { continue; }
+        uint32_t offset = i * type.writeBlockSize;
+        addWrite(PloaderStep::WRITE_FLASH_BLOCK, type.appAddress + offset,
+            image + offset, type.writeBlockSize);
+    }
+}
+
+void PloaderPlan::writeEeprom(const PloaderType & type, const uint8_t * image)
+{
+    type.ensureEepromAccess();
+
+    image = copy(image, type.eepromSize);
+
+    const uint32_t blockSize = PLOADER_EEPROM_BLOCK_SIZE;
+    for (uint32_t offset = 0; offset < type.eepromSize; offset += blockSize)
+    {
+        addWrite(PloaderStep::WRITE_EEPROM_BLOCK, type.eepromAddress + offset,
+            image + offset, blockSize);
+    }
+}
+
+void PloaderPlan::eraseEeprom(const PloaderType & type)
+{
+    std::vector<uint8_t> image(type.eepromSize, 0xFF);
+    writeEeprom(type, &image[0]);
+}
+
+void PloaderPlan::applyImage(const PloaderType & type,
+    const FirmwareArchive::Image & image)
 {
     initialize(image.uploadType);
 
@@ -655,34 +1000,99 @@ void PloaderHandle::applyImage(const FirmwareArchive::Image & image)
         // We erase the first byte of EEPROM so that the firmware is able to
         // know it has been upgraded and not accidentally use invalid settings
         // from an older version of the firmware.
-        eraseEepromFirstByte();
+        static const uint8_t blankByte = 0xFF;
+        addWrite(PloaderStep::WRITE_EEPROM_BLOCK, 0, &blankByte, 1);
     }
 
-    size_t progress = 0;
     for (const FirmwareArchive::Block & block : image.blocks)
     {
-        writeFlashBlock(block.address, &block.data[0], block.data.size());
+        addWrite(PloaderStep::WRITE_FLASH_BLOCK, block.address,
+            &block.data[0], block.data.size());
+    }
+}
 
-        if (listener)
+void PloaderPlan::optimize()
+{
+    std::vector<bool> keep(steps.size(), true);
+
+    // Erasing flash undoes all the flash erases and writes before it, so only
+    // the last erase and the writes after it are needed.
+    size_t lastErase = steps.size();
+    for (size_t i = 0; i < steps.size(); i++)
+    {
+        assert(steps[i].kind != PloaderStep::RESTART);
+        if (steps[i].kind == PloaderStep::ERASE_FLASH)
         {
-            progress++;
-            listener->setStatus("Writing flash...", progress, image.blocks.size());
+            lastErase = i;
+        }
+    }
+    for (size_t i = 0; lastErase < steps.size() && i < lastErase; i++)
+    {
+        if (steps[i].kind == PloaderStep::ERASE_FLASH ||
+            steps[i].kind == PloaderStep::WRITE_FLASH_BLOCK)
+        {
+            keep[i] = false;
         }
     }
-}
 
-void PloaderHandle::restartDevice()
-{
-    const uint16_t durationMs = 100;
-    try
+    // An EEPROM write is not needed if later writes cover all of its bytes.
+    std::vector<bool> eepromWritten;
+    for (size_t i = steps.size(); i-- > 0; )
     {
-        handle.control_transfer(0x40, REQUEST_RESTART, durationMs, 0);
+        const PloaderStep & step = steps[i];
+        if (step.kind != PloaderStep::WRITE_EEPROM_BLOCK) { continue; }
+
+        uint32_t end = step.address + step.size;
+        if (eepromWritten.size() < end)
+        {
+            eepromWritten.resize(end, false);
+        }
+
+        bool covered = true;
+        for (uint32_t address = step.address; address < end; address++)
+        {
+            if (!eepromWritten[address])
+            {
+                covered = false;
+                eepromWritten[address] = true;
+            }
+        }
+        keep[i] = !covered;
     }
-    catch(const libusbp::error & error)
+
+    // Initializing is only needed if flash is erased or written before the
+    // next initialization.
+    bool flashStepFollows = false;
+    for (size_t i = steps.size(); i-- > 0; )
     {
-        throw std::runtime_error(
-            std::string("Failed to restart device.") + error.what());
+        if (!keep[i]) { continue; }
+
+        switch (steps[i].kind)
+        {
+        case PloaderStep::ERASE_FLASH:
+        case PloaderStep::WRITE_FLASH_BLOCK:
+            flashStepFollows = true;
+            break;
+
+        case PloaderStep::INITIALIZE:
+            keep[i] = flashStepFollows;
+            flashStepFollows = false;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < steps.size(); i++)
+    {
+        if (keep[i])
+        {
+            steps[count++] = steps[i];
+        }
     }
+    steps.resize(count);
 }
 
 bool PloaderHandle::checkApplication()
@@ -2,6 +2,7 @@
 
 #include "p-load.h"
 #include <vector>
+#include <list>
 #include "firmware_archive.h"
 
 #define UPLOAD_TYPE_STANDARD 0
@@ -15,6 +16,78 @@ enum MemorySet
     MEMORY_SET_EEPROM,
 };
 
+// The bootloaders read flash in blocks of this size, and read and write EEPROM
+// in blocks of this size.
+#define PLOADER_FLASH_READ_BLOCK_SIZE 1024
+#define PLOADER_EEPROM_BLOCK_SIZE 32
+
+/* The kinds of bootloader operations that we time and predict the durations
+ * of.  Erasing flash counts as one operation even though it takes several
+ * requests. */
+enum PloaderOperation
+{
+    PLOADER_OP_INITIALIZE,
+    PLOADER_OP_ERASE_FLASH,
+    PLOADER_OP_WRITE_FLASH_BLOCK,
+    PLOADER_OP_WRITE_EEPROM_BLOCK,
+    PLOADER_OP_READ_FLASH_BLOCK,
+    PLOADER_OP_READ_EEPROM_BLOCK,
+    PLOADER_OP_RESTART,
+    PLOADER_OP_COUNT
+};
+
+/* Expected durations of each kind of operation on one type of bootloader, in
+ * microseconds, including the USB transfers. */
+struct PloaderTiming
+{
+    uint32_t duration[PLOADER_OP_COUNT];
+};
+
+/* Counts of the operations done on a bootloader and the total time they took,
+ * as measured by PloaderHandle. */
+struct PloaderStats
+{
+    PloaderStats() : count(), seconds() { }
+
+    void add(const PloaderStats & other)
+    {
+        for (int i = 0; i < PLOADER_OP_COUNT; i++)
+        {
+            count[i] += other.count[i];
+            seconds[i] += other.seconds[i];
+        }
+    }
+
+    uint32_t count[PLOADER_OP_COUNT];
+    double seconds[PLOADER_OP_COUNT];
+};
+
+// The maximum number of app types that can correspond to one bootloader type.
+#define PLOADER_MAX_MATCHING_APP_TYPES 4
+
+// The maximum number of app types and bootloader types in one user type.
+#define PLOADER_MAX_USER_TYPE_MEMBERS 12
+
+/** A read-only view of one of the constant tables of device types defined in
+ * ploader_data.cpp.  It can be used in range-based for loops. */
+template <typename T> class PloaderTable
+{
+public:
+    template <size_t N> constexpr PloaderTable(const T (&items)[N])
+        : items(items), count(N)
+    {
+    }
+
+    const T * begin() const { return items; }
+    const T * end() const { return items + count; }
+    size_t size() const { return count; }
+    const T & operator[](size_t i) const { return items[i]; }
+
+private:
+    const T * items;
+    size_t count;
+};
+
 /** Represents a type of USB device that can be used to start a bootloader.
  * Currently, just native USB interfaces are supported, but we could add more
  * fields in the future to support USB serial ports and USB HIDs. */
@@ -37,24 +110,35 @@ public:
     }
 };
 
-extern const std::vector<PloaderAppType> ploaderAppTypes;
+extern const PloaderTable<PloaderAppType> ploaderAppTypes;
 
 /** Represents a specific device connected to the system
- * that we could use to start a bootloader. */
+ * that we could use to start a bootloader.
+ *
+ * The type pointer refers to an entry in the static ploaderAppTypes table, so
+ * instances are cheap to move around while we filter lists of them. */
 class PloaderAppInstance
 {
 public:
-    PloaderAppType type;
+    const PloaderAppType * type;
     std::string serialNumber;
 
-    PloaderAppInstance()
+    /* An operating system-specific string that identifies the USB device. */
+    std::string osId;
+
+    /* The physical USB port the device is plugged into, e.g. "1-2.3" for
+     * port 3 of a hub on port 2 of bus 1.  Empty if it is not known. */
+    std::string portPath;
+
+    PloaderAppInstance() : type(NULL)
     {
     }
 
-    PloaderAppInstance(const PloaderAppType type,
+    PloaderAppInstance(const PloaderAppType & type,
         libusbp::generic_interface gi,
         std::string serialNumber)
-        : type(type), serialNumber(serialNumber), usbInterface(gi)
+        : type(&type), serialNumber(std::move(serialNumber)),
+          usbInterface(std::move(gi))
     {
     }
 
@@ -115,7 +199,13 @@ public:
 
     const uint8_t * deviceCode;
 
-    std::vector<uint32_t> matchingAppTypes;
+    /* IDs of the PloaderAppType objects that correspond to this bootloader,
+     * terminated by a zero if there are fewer than the maximum. */
+    uint32_t matchingAppTypes[PLOADER_MAX_MATCHING_APP_TYPES];
+
+    /* Rough durations of the bootloader operations, used to predict how long
+     * a plan will take.  The --stats option measures the real durations. */
+    PloaderTiming timing;
 
     bool memorySetIncludesFlash(MemorySet ms) const;
     bool memorySetIncludesEeprom(MemorySet ms) const;
@@ -139,7 +229,7 @@ public:
     /* Returns a vector of the app types that correspond to this bootloader.
      * When trying to write to this bootloader, these are the apps that you
      * should consider restarting. */
-    std::vector<PloaderAppType> getMatchingAppTypes() const;
+    std::vector<const PloaderAppType *> getMatchingAppTypes() const;
 
     bool operator ==(const PloaderType & other) const
     {
@@ -147,28 +237,37 @@ public:
     }
 };
 
-extern const std::vector<PloaderType> ploaderTypes;
+extern const PloaderTable<PloaderType> ploaderTypes;
 
 /** Represents a specific bootloader connected to the system
- * and ready to be used. */
+ * and ready to be used.  The type pointer refers to an entry in the static
+ * ploaderTypes table. */
 class PloaderInstance
 {
 public:
-    PloaderType type;
+    const PloaderType * type;
     std::string serialNumber;
 
-    PloaderInstance()
+    /* An operating system-specific string that identifies the USB device. */
+    std::string osId;
+
+    /* The physical USB port the device is plugged into.  See
+     * PloaderAppInstance::portPath. */
+    std::string portPath;
+
+    PloaderInstance() : type(NULL)
     {
     }
 
-    PloaderInstance(const PloaderType type,
+    PloaderInstance(const PloaderType & type,
         libusbp::generic_interface gi,
         std::string serialNumber)
-        : type(type), serialNumber(serialNumber), usbInterface(gi)
+        : type(&type), serialNumber(std::move(serialNumber)),
+          usbInterface(std::move(gi))
     {
     }
 
-    operator bool()
+    operator bool() const
     {
         return usbInterface;
     }
@@ -191,21 +290,41 @@ public:
     const char * name;
 
     /* IDs of PloaderAppType and PloaderBootloaderType objects
-     * that belong to this type/family. */
-    std::vector<uint32_t> memberIds;
+     * that belong to this type/family, terminated by a zero if there are
+     * fewer than the maximum. */
+    uint32_t memberIds[PLOADER_MAX_USER_TYPE_MEMBERS];
 
-    std::vector<PloaderType> getMatchingTypes() const;
-    std::vector<PloaderAppType> getMatchingAppTypes() const;
+    std::vector<const PloaderType *> getMatchingTypes() const;
+    std::vector<const PloaderAppType *> getMatchingAppTypes() const;
 };
 
-extern const std::vector<PloaderUserType> ploaderUserTypes;
+extern const PloaderTable<PloaderUserType> ploaderUserTypes;
 
 const PloaderAppType * ploaderAppTypeLookup(uint16_t usbVendorId, uint16_t usbProductId);
 
 const PloaderType * ploaderTypeLookup(uint16_t usbVendorId, uint16_t usbProductId);
 
+const PloaderAppType * ploaderAppTypeLookupById(uint32_t id);
+
+const PloaderType * ploaderTypeLookupById(uint32_t id);
+
 const PloaderUserType * ploaderUserTypeLookup(std::string codeName);
 
+/** Returns the path of the physical USB port the device is plugged into, in
+ * the format Linux uses: the bus number, a dash, and then the port numbers of
+ * each hub separated by dots, e.g. "1-2.3".  This does not require any USB
+ * requests.  Returns an empty string on systems where port paths are not
+ * supported. */
+std::string ploaderGetPortPath(const libusbp::device &);
+
+/** Returns an instance for the specified USB device if it is a known app that
+ * is ready to be used, or a null instance otherwise. */
+PloaderAppInstance ploaderGetApp(const libusbp::device &);
+
+/** Returns an instance for the specified USB device if it is a known
+ * bootloader that is ready to be used, or a null instance otherwise. */
+PloaderInstance ploaderGetBootloader(const libusbp::device &);
+
 /** Detects all the known apps that are currently connected to the computer.  */
 std::vector<PloaderAppInstance> ploaderListApps();
 
@@ -220,12 +339,98 @@ public:
         uint32_t progress, uint32_t maxProgress) = 0;
 };
 
+/* One request to a bootloader, as part of a PloaderPlan. */
+struct PloaderStep
+{
+    enum Kind
+    {
+        INITIALIZE,
+        ERASE_FLASH,
+        WRITE_FLASH_BLOCK,
+        WRITE_EEPROM_BLOCK,
+        RESTART,
+    };
+
+    Kind kind;
+
+    // The upload type for INITIALIZE.
+    uint16_t uploadType;
+
+    // The address, data, and size for the write steps.
+    uint32_t address;
+    const uint8_t * data;
+    uint32_t size;
+};
+
+/* A PloaderPlan is a list of bootloader requests that does a whole operation,
+ * like writing a firmware image, built ahead of time.  The steps can be run
+ * one request at a time with a PloaderPlanRunner, so one thread can interleave
+ * the operations of many devices, and the same plan can be used for any
+ * number of devices of the same type.
+ *
+ * The functions that add steps have the same names and meanings as the
+ * PloaderHandle functions that do the same thing right away. */
+class PloaderPlan
+{
+public:
+    PloaderPlan() { }
+
+    // The steps point to the plan's copies of the data, so copying a plan
+    // would make steps that point to the wrong copy.  Moving is fine.
+    PloaderPlan(const PloaderPlan &) = delete;
+    PloaderPlan & operator=(const PloaderPlan &) = delete;
+    PloaderPlan(PloaderPlan &&) = default;
+    PloaderPlan & operator=(PloaderPlan &&) = default;
+
+    void initialize(uint16_t uploadType);
+    void initialize(const PloaderType & type);
+    void eraseFlash();
+
+    /** Adds steps that write the non-empty blocks of the image, which must be
+     * type.appSize bytes.  The image is copied. */
+    void writeFlash(const PloaderType & type, const uint8_t * image);
+
+    /** Adds steps that write the image to EEPROM, which must be
+     * type.eepromSize bytes.  The image is copied. */
+    void writeEeprom(const PloaderType & type, const uint8_t * image);
+
+    void eraseEeprom(const PloaderType & type);
+
+    /** Adds the steps to apply a firmware image.  The image's data is not
+     * copied, so it must remain valid as long as the plan is used. */
+    void applyImage(const PloaderType & type, const FirmwareArchive::Image & image);
+
+    void restartDevice();
+
+    /** Adds the steps of another plan.  The data is not copied, so the other
+     * plan must remain valid as long as this plan is used. */
+    void append(const PloaderPlan & other);
+
+    /** Removes the steps that would not change the final state of the device:
+     * flash erases and writes that a later erase undoes, EEPROM writes that
+     * later writes cover, and initializations that are not followed by a
+     * flash erase or write.  Call this before adding a restart. */
+    void optimize();
+
+    std::vector<PloaderStep> steps;
+
+private:
+    void addWrite(PloaderStep::Kind, uint32_t address, const uint8_t * data,
+        uint32_t size);
+
+    const uint8_t * copy(const uint8_t * data, size_t size);
+
+    // Copies of the data that the steps point to.  Elements of a list do not
+    // move in memory.
+    std::list<std::vector<uint8_t>> buffers;
+};
+
 class PloaderHandle
 {
 public:
-    PloaderHandle(PloaderInstance);
+    PloaderHandle(const PloaderInstance &);
 
-    PloaderHandle() { }
+    PloaderHandle() : type(NULL), listener(NULL) { }
 
     operator bool() const noexcept { return handle; }
 
@@ -256,6 +461,12 @@ public:
      * Wixel in to bootloader mode (if needed) and reading the image. */
     void readFlash(uint8_t * image);
 
+    /** Reads size bytes of flash starting at startAddress into buffer.  The
+     * range must be inside the app region, but it does not need to be aligned:
+     * this function reads whole blocks from the device and only copies out the
+     * requested bytes. */
+    void readFlash(uint8_t * buffer, uint32_t startAddress, uint32_t size);
+
     /** Erases the EEPROM (sets to 0xFF). **/
     void eraseEeprom();
 
@@ -265,6 +476,10 @@ public:
     /** Just like readFlash, but for EEPROM instead. */
     void readEeprom(uint8_t * image);
 
+    /** Just like the ranged version of readFlash, but for EEPROM instead.
+     * startAddress uses the same address space as eepromAddress. */
+    void readEeprom(uint8_t * buffer, uint32_t startAddress, uint32_t size);
+
     /** Sends the Restart command, which causes the device device to reset.  This is
      * usually used to allow a newly-loaded application to start running. */
     void restartDevice();
@@ -273,27 +488,108 @@ public:
      * Returns true if the application is valid. */
     bool checkApplication();
 
+    /** Returns true if the application flash region is already blank (all
+     * 0xFF), and EEPROM too if erasing flash would erase it, so erasing is
+     * not needed.  This returns false without reading anything if the
+     * bootloader cannot read flash or reports a valid application. */
+    bool flashIsBlank();
+
     /** Erases flash and performs any other steps needed to apply the firmware
      * image to the device. */
     void applyImage(const FirmwareArchive::Image & image);
 
-    PloaderType type;
+    /** Does one request from a PloaderPlan.  Returns false if the step is not
+     * done yet and should be executed again, which happens while the
+     * bootloader is erasing flash. */
+    bool executeStep(const PloaderStep & step);
+
+    /** Does all the steps of a plan with a PloaderPlanRunner. */
+    void executePlan(const PloaderPlan & plan);
+
+    /** The type of the bootloader, which points to an entry in the static
+     * ploaderTypes table. */
+    const PloaderType * type;
 
     void setStatusListener(PloaderStatusListener * listener)
     {
         this->listener = listener;
     }
 
+    /** Returns the operations done with this handle and how long they took. */
+    const PloaderStats & getStats() const
+    {
+        return stats;
+    }
+
 private:
+    friend class PloaderPlanRunner;
+
     void writeFlashBlock(const uint32_t address, const uint8_t * data, size_t size);
     void writeEepromBlock(const uint32_t address, const uint8_t * data, size_t size);
-    void eraseEepromFirstByte();
+    uint8_t eraseFlashRequest();
 
     void reportError(const libusbp::error & error, std::string context)
         __attribute__((noreturn));
 
+    // Adds the time since startTime to the stats for an operation.  If done
+    // is false, the operation is not counted yet because it will take more
+    // requests.
+    void recordOperation(PloaderOperation,
+        std::chrono::steady_clock::time_point startTime, bool done = true);
+
     PloaderStatusListener * listener;
 
+    PloaderStats stats;
+
     libusbp::generic_handle handle;
 };
 
+/* Runs the steps of a plan on a bootloader one request at a time, reporting
+ * progress to the handle's status listener.  PloaderHandle::executePlan uses
+ * it to run a whole plan, and the single-threaded executor uses it to take
+ * turns between many devices, so both behave the same way.
+ *
+ * Erasing flash is skipped if flashIsBlank() says it is not needed.  If the
+ * bootloader then refuses the first flash write, the plan is done again from
+ * the initialization before the erase, this time with the erase. */
+class PloaderPlanRunner
+{
+public:
+    /** The handle and the plan must remain valid as long as this object is
+     * used. */
+    PloaderPlanRunner(PloaderHandle &, const PloaderPlan &);
+
+    /** Does the next request of the plan.  Returns false if the plan was
+     * already done. */
+    bool step();
+
+private:
+    void startWriteRun();
+
+    PloaderHandle * handle;
+    const PloaderPlan * plan;
+
+    // The index of the next step.
+    size_t index;
+
+    // The erase step we are in the middle of, which takes several requests.
+    bool erasing;
+    uint32_t maxEraseProgress;
+
+    // True if we skipped erasing flash because it was already blank and have
+    // not written any flash since then.
+    bool eraseSkipped;
+
+    // The index of the erase step we skipped.
+    size_t skippedEraseIndex;
+
+    // True if the bootloader refused a write after we skipped the erase, so
+    // the erase must not be skipped again.
+    bool eraseRequired;
+
+    // The run of writes to the same memory that we are doing, so we can
+    // report progress for the whole run.
+    size_t runStart, runEnd;
+    const char * runMessage;
+};
+
@@ -27,9 +27,10 @@ enum PloaderTypeIds
     ID_SMC_18V25_BOOTLOADER,
     ID_SMC_18V25_APP,
 #endif
+    ID_COUNT
 };
 
-const std::vector<PloaderAppType> ploaderAppTypes = {
+static constexpr PloaderAppType appTypes[] = {
     {
         /* id */ ID_PGM04A_APP,
         /* usbVendorId */ 0x1FFB,
@@ -114,7 +115,34 @@ const std::vector<PloaderAppType> ploaderAppTypes = {
 #endif
 };
 
-const std::vector<PloaderType> ploaderTypes = {
+// Rough durations of bootloader operations on the PIC18 bootloaders, in
+// microseconds.  Erasing takes about 3 ms per 64-byte page of the 24 KB app
+// region, and EEPROM writes take about 4 ms per byte.
+static constexpr PloaderTiming pic18Timing = { {
+    /* initialize */ 1000,
+    /* eraseFlash */ 1150000,
+    /* writeFlashBlock */ 2000,
+    /* writeEepromBlock */ 130000,
+    /* readFlashBlock */ 3000,
+    /* readEepromBlock */ 1000,
+    /* restart */ 1000,
+} };
+
+#ifndef NDEBUG
+// Rough durations of bootloader operations on the STM32 bootloader of the
+// Simple Motor Controller, in microseconds.
+static constexpr PloaderTiming stm32Timing = { {
+    /* initialize */ 1000,
+    /* eraseFlash */ 1000000,
+    /* writeFlashBlock */ 1500,
+    /* writeEepromBlock */ 0,
+    /* readFlashBlock */ 0,
+    /* readEepromBlock */ 0,
+    /* restart */ 1000,
+} };
+#endif
+
+static constexpr PloaderType bootloaderTypes[] = {
     {
         /* id */ ID_P_STAR_25K50_BOOTLOADER,
         /* usbVendorId */ 0x1FFB,
@@ -132,6 +160,7 @@ const std::vector<PloaderType> ploaderTypes = {
         /* supportsEepromAccess */ true,
         /* deviceCode */ NULL,
         /* matchingAppTypes */ { },
+        /* timing */ pic18Timing,
     },
     {
         /* id */ ID_P_STAR_45K50_BOOTLOADER,
@@ -150,6 +179,7 @@ const std::vector<PloaderType> ploaderTypes = {
         /* supportsEepromAccess */ true,
         /* deviceCode */ NULL,
         /* matchingAppTypes */ { },
+        /* timing */ pic18Timing,
     },
     {
         /* id */ ID_PGM04A_BOOTLOADER,
@@ -168,6 +198,7 @@ const std::vector<PloaderType> ploaderTypes = {
         /* supportsEepromAccess */ true,
         /* deviceCode */ NULL,
         /* matchingAppTypes */ { ID_PGM04A_APP },
+        /* timing */ pic18Timing,
     },
     {
         /* id */ ID_PGM04B_BOOTLOADER,
@@ -186,6 +217,7 @@ const std::vector<PloaderType> ploaderTypes = {
         /* supportsEepromAccess */ true,
         /* deviceCode */ NULL,
         /* matchingAppTypes */ { ID_PGM04B_APP },
+        /* timing */ pic18Timing,
     },
     {
         /* id */ ID_TIC_T825_BOOTLOADER,
@@ -204,6 +236,7 @@ const std::vector<PloaderType> ploaderTypes = {
         /* supportsEepromAccess */ true,
         /* deviceCode */ NULL,
         /* matchingAppTypes */ { ID_TIC_T825_APP },
+        /* timing */ pic18Timing,
     },
     {
         /* id */ ID_TIC_T834_BOOTLOADER,
@@ -222,6 +255,7 @@ const std::vector<PloaderType> ploaderTypes = {
         /* supportsEepromAccess */ true,
         /* deviceCode */ NULL,
         /* matchingAppTypes */ { ID_TIC_T834_APP },
+        /* timing */ pic18Timing,
     },
     {
         /* id */ ID_TIC_T500_BOOTLOADER,
@@ -240,6 +274,7 @@ const std::vector<PloaderType> ploaderTypes = {
         /* supportsEepromAccess */ true,
         /* deviceCode */ NULL,
         /* matchingAppTypes */ { ID_TIC_T500_APP },
+        /* timing */ pic18Timing,
     },
     {
         /* id */ ID_JRK_UMC04A_30V_BOOTLOADER,
@@ -258,6 +293,7 @@ const std::vector<PloaderType> ploaderTypes = {
         /* supportsEepromAccess */ true,
         /* deviceCode */ NULL,
         /* matchingAppTypes */ { ID_JRK_UMC04A_30V_APP },
+        /* timing */ pic18Timing,
     },
     {
         /* id */ ID_JRK_UMC04A_40V_BOOTLOADER,
@@ -276,6 +312,7 @@ const std::vector<PloaderType> ploaderTypes = {
         /* supportsEepromAccess */ true,
         /* deviceCode */ NULL,
         /* matchingAppTypes */ { ID_JRK_UMC04A_40V_APP },
+        /* timing */ pic18Timing,
     },
     {
         /* id */ ID_JRK_UMC05A_30V_BOOTLOADER,
@@ -294,6 +331,7 @@ const std::vector<PloaderType> ploaderTypes = {
         /* supportsEepromAccess */ true,
         /* deviceCode */ NULL,
         /* matchingAppTypes */ { ID_JRK_UMC05A_30V_APP },
+        /* timing */ pic18Timing,
     },
     {
         /* id */ ID_JRK_UMC05A_40V_BOOTLOADER,
@@ -312,6 +350,7 @@ const std::vector<PloaderType> ploaderTypes = {
         /* supportsEepromAccess */ true,
         /* deviceCode */ NULL,
         /* matchingAppTypes */ { ID_JRK_UMC05A_40V_APP },
+        /* timing */ pic18Timing,
     },
 #ifndef NDEBUG
     {
@@ -331,11 +370,12 @@ const std::vector<PloaderType> ploaderTypes = {
         /* supportsEepromAccess */ false,
         /* deviceCode */ NULL,
         /* matchingAppTypes */ { ID_SMC_18V25_APP },
+        /* timing */ stm32Timing,
     },
 #endif
 };
 
-const std::vector<PloaderUserType> ploaderUserTypes = {
+static constexpr PloaderUserType userTypes[] = {
     {
         /* codeName */ "p-star",
         /* name */ "Pololu P-Star",
@@ -425,3 +465,170 @@ const std::vector<PloaderUserType> ploaderUserTypes = {
     },
 #endif
 };
+
+constexpr PloaderTable<PloaderAppType> ploaderAppTypes(appTypes);
+constexpr PloaderTable<PloaderType> ploaderTypes(bootloaderTypes);
+constexpr PloaderTable<PloaderUserType> ploaderUserTypes(userTypes);
+
+/* The tables above are searched very often while enumerating USB devices, so
+ * we build hash tables for them at compile time.  Everything below is
+ * evaluated by the compiler: there are no static constructors, no heap
+ * allocations, and each lookup is a multiplication, a shift, and one
+ * comparison.
+ *
+ * The code is written in the restricted style that C++11 requires for
+ * constexpr functions (a single return statement each). */
+
+// Number of bits in a hash table index.  The tables have 32 slots, which is
+// plenty of room for the number of types we support.
+#define HASH_BITS 5
+#define HASH_SLOTS (1 << HASH_BITS)
+
+template <size_t... I> struct IndexList { };
+
+template <size_t N, size_t... I> struct MakeIndexList
+    : MakeIndexList<N - 1, N - 1, I...> { };
+
+template <size_t... I> struct MakeIndexList<0, I...>
+{
+    typedef IndexList<I...> type;
+};
+
+// A table that maps small integers (type IDs or hash values) to indices in
+// one of the type tables above.  An entry of -1 means there is no such type.
+template <size_t N> struct IndexTable
+{
+    int8_t index[N];
+};
+
+static constexpr uint32_t usbIdHash(uint16_t usbVendorId,
+    uint16_t usbProductId, uint32_t multiplier)
+{
+    return ((uint32_t)usbVendorId << 16 | usbProductId) * multiplier
+        >> (32 - HASH_BITS);
+}
+
+template <typename T>
+static constexpr uint32_t usbIdHash(const T & type, uint32_t multiplier)
+{
+    return usbIdHash(type.usbVendorId, type.usbProductId, multiplier);
+}
+
+// Returns true if two entries in the table with indices i and j >= i have the
+// same hash.
+template <typename T, size_t N>
+static constexpr bool hashCollides(const T (&table)[N], uint32_t multiplier,
+    size_t i = 0, size_t j = 1)
+{
+    return i >= N ? false :
+        j >= N ? hashCollides(table, multiplier, i + 1, i + 2) :
+        usbIdHash(table[i], multiplier) == usbIdHash(table[j], multiplier) ? true :
+        hashCollides(table, multiplier, i, j + 1);
+}
+
+// Searches for a multiplier that gives a perfect hash (no collisions) for the
+// USB IDs in the specified table.
+template <typename T, size_t N>
+static constexpr uint32_t findHashMultiplier(const T (&table)[N],
+    uint32_t multiplier = 0x9E3779B1)
+{
+    return !hashCollides(table, multiplier) ? multiplier :
+        findHashMultiplier(table, multiplier + 2);
+}
+
+template <typename T, size_t N>
+static constexpr int8_t indexWithHash(const T (&table)[N],
+    uint32_t multiplier, uint32_t hash, size_t i = 0)
+{
+    return i >= N ? -1 :
+        usbIdHash(table[i], multiplier) == hash ? (int8_t)i :
+        indexWithHash(table, multiplier, hash, i + 1);
+}
+
+template <typename T, size_t N, size_t... S>
+static constexpr IndexTable<HASH_SLOTS> buildHashTable(const T (&table)[N],
+    uint32_t multiplier, IndexList<S...>)
+{
+    return {{ indexWithHash(table, multiplier, S)... }};
+}
+
+template <typename T, size_t N>
+static constexpr int8_t indexWithId(const T (&table)[N],
+    uint32_t id, size_t i = 0)
+{
+    return i >= N ? -1 :
+        table[i].id == id ? (int8_t)i :
+        indexWithId(table, id, i + 1);
+}
+
+template <typename T, size_t N, size_t... I>
+static constexpr IndexTable<ID_COUNT> buildIdTable(const T (&table)[N],
+    IndexList<I...>)
+{
+    return {{ indexWithId(table, I)... }};
+}
+
+static_assert(sizeof(appTypes) / sizeof(appTypes[0]) < HASH_SLOTS,
+    "Too many app types for the hash table.");
+static_assert(sizeof(bootloaderTypes) / sizeof(bootloaderTypes[0]) < HASH_SLOTS,
+    "Too many bootloader types for the hash table.");
+static_assert(ID_COUNT < 128, "Type IDs do not fit in the index tables.");
+
+static constexpr uint32_t appTypeHashMultiplier = findHashMultiplier(appTypes);
+
+static constexpr uint32_t bootloaderTypeHashMultiplier =
+    findHashMultiplier(bootloaderTypes);
+
+static constexpr IndexTable<HASH_SLOTS> appTypeHashTable = buildHashTable(
+    appTypes, appTypeHashMultiplier, MakeIndexList<HASH_SLOTS>::type());
+
+static constexpr IndexTable<HASH_SLOTS> bootloaderTypeHashTable = buildHashTable(
+    bootloaderTypes, bootloaderTypeHashMultiplier, MakeIndexList<HASH_SLOTS>::type());
+
+static constexpr IndexTable<ID_COUNT> appTypeIdTable = buildIdTable(
+    appTypes, MakeIndexList<ID_COUNT>::type());
+
+static constexpr IndexTable<ID_COUNT> bootloaderTypeIdTable = buildIdTable(
+    bootloaderTypes, MakeIndexList<ID_COUNT>::type());
+
+const PloaderAppType * ploaderAppTypeLookup(uint16_t usbVendorId, uint16_t usbProductId)
+{
+    uint32_t hash = usbIdHash(usbVendorId, usbProductId, appTypeHashMultiplier);
+    int8_t index = appTypeHashTable.index[hash];
+    if (index < 0) { return NULL; }
+    const PloaderAppType & t = appTypes[index];
+    if (t.usbVendorId != usbVendorId || t.usbProductId != usbProductId)
+    {
+        return NULL;
+    }
+    return &t;
+}
+
+const PloaderType * ploaderTypeLookup(uint16_t usbVendorId, uint16_t usbProductId)
+{
+    uint32_t hash = usbIdHash(usbVendorId, usbProductId, bootloaderTypeHashMultiplier);
+    int8_t index = bootloaderTypeHashTable.index[hash];
+    if (index < 0) { return NULL; }
+    const PloaderType & t = bootloaderTypes[index];
+    if (t.usbVendorId != usbVendorId || t.usbProductId != usbProductId)
+    {
+        return NULL;
+    }
+    return &t;
+}
+
+const PloaderAppType * ploaderAppTypeLookupById(uint32_t id)
+{
+    if (id >= ID_COUNT) { return NULL; }
+    int8_t index = appTypeIdTable.index[id];
+    if (index < 0) { return NULL; }
+    return &appTypes[index];
+}
+
+const PloaderType * ploaderTypeLookupById(uint32_t id)
+{
+    if (id >= ID_COUNT) { return NULL; }
+    int8_t index = bootloaderTypeIdTable.index[id];
+    if (index < 0) { return NULL; }
+    return &bootloaderTypes[index];
+}
@@ -0,0 +1,230 @@
+#include "scheduler.h"
+#include <algorithm>
+#include <cassert>
+
+// We never use more threads than this, regardless of how many devices there
+// are.  Most of the time threads are just waiting for USB transfers or for
+// devices to enumerate, so this can be larger than the number of CPUs.
+#define MAX_THREADS 64
+
+Scheduler::Scheduler(uint32_t maxPerController, uint32_t launchIntervalMs)
+    : maxPerController(maxPerController), launchIntervalMs(launchIntervalMs)
+{
+    assert(maxPerController > 0);
+}
+
+Scheduler::~Scheduler()
+{
+    joinStartedJobs(true);
+}
+
+std::string Scheduler::controllerName(const std::string & portPath)
+{
+    return portPath.substr(0, portPath.find('-'));
+}
+
+std::string Scheduler::hubName(const std::string & portPath)
+{
+    size_t dot = portPath.rfind('.');
+    if (dot != std::string::npos)
+    {
+        return portPath.substr(0, dot);
+    }
+    return controllerName(portPath);
+}
+
+void Scheduler::addJob(const std::string & portPath, Job job)
+{
+    QueuedJob queued;
+    queued.hub = hubName(portPath);
+    queued.job = job;
+    controllers[controllerName(portPath)].queue.push_back(queued);
+}
+
+// Reorders the jobs for one controller so that we take one job from each hub
+// in turn, instead of doing all of the devices on one hub before moving on to
+// the next.
+void Scheduler::orderQueue(std::deque<QueuedJob> & queue)
+{
+    std::map<std::string, std::deque<QueuedJob>> byHub;
+    for (QueuedJob & job : queue)
+    {
+        byHub[job.hub].push_back(job);
+    }
+
+    queue.clear();
+    while (!byHub.empty())
+    {
+        for (auto it = byHub.begin(); it != byHub.end(); )
+        {
+            queue.push_back(it->second.front());
+            it->second.pop_front();
+            if (it->second.empty())
+            {
+                it = byHub.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+}
+
+void Scheduler::run()
+{
+    size_t jobCount = 0;
+    std::vector<std::string> homes;
+    for (auto & pair : controllers)
+    {
+        orderQueue(pair.second.queue);
+        jobCount += pair.second.queue.size();
+        homes.push_back(pair.first);
+    }
+
+    if (jobCount == 0) { return; }
+
+    // Use enough threads that each controller can have twice as many jobs in
+    // progress as it has transfer slots, so some jobs can wait for their
+    // bootloaders to enumerate while others are transferring data.
+    size_t threadCount = std::min<size_t>(jobCount,
+        homes.size() * maxPerController * 2);
+    threadCount = std::min<size_t>(threadCount, MAX_THREADS);
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < threadCount; i++)
+    {
+        threads.emplace_back(&Scheduler::worker, this, homes[i % homes.size()]);
+    }
+
+    for (std::thread & thread : threads)
+    {
+        thread.join();
+    }
+}
+
+bool Scheduler::takeJob(const std::string & home, Job & job)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (1)
+    {
+        Controller & homeController = controllers[home];
+        if (!homeController.queue.empty())
+        {
+            job = homeController.queue.front().job;
+            homeController.queue.pop_front();
+            return true;
+        }
+
+        // Steal from the back of the longest queue whose controller has a
+        // free transfer slot.  A job from a controller with no free slot
+        // would just wait for one on this thread instead of on its home
+        // threads.
+        Controller * victim = NULL;
+        bool jobsLeft = false;
+        for (auto & pair : controllers)
+        {
+            Controller & c = pair.second;
+            if (c.queue.empty()) { continue; }
+            jobsLeft = true;
+            if (c.activeTransfers >= maxPerController) { continue; }
+            if (!victim || c.queue.size() > victim->queue.size())
+            {
+                victim = &c;
+            }
+        }
+
+        if (!jobsLeft) { return false; }
+
+        if (victim)
+        {
+            job = victim->queue.back().job;
+            victim->queue.pop_back();
+            return true;
+        }
+
+        // Wait for a transfer to finish, which might free a slot.
+        transferDone.wait(lock);
+    }
+}
+
+void Scheduler::worker(std::string home)
+{
+    Job job;
+    while (takeJob(home, job))
+    {
+        job();
+    }
+}
+
+void Scheduler::startJob(Job job)
+{
+    StartedJob started;
+    started.done = std::make_shared<std::atomic<bool>>(false);
+    std::shared_ptr<std::atomic<bool>> done = started.done;
+    started.thread = std::thread([job, done]()
+    {
+        job();
+        *done = true;
+    });
+    startedJobs.push_back(std::move(started));
+}
+
+void Scheduler::joinStartedJobs(bool wait)
+{
+    for (auto it = startedJobs.begin(); it != startedJobs.end(); )
+    {
+        if (wait || *it->done)
+        {
+            it->thread.join();
+            it = startedJobs.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+void Scheduler::waitToLaunch(const std::string & portPath)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    Controller & c = controllers[controllerName(portPath)];
+
+    // Reserve the next launch time for this controller, then sleep until it
+    // arrives.
+    Clock::time_point now = Clock::now();
+    Clock::time_point launchTime = now;
+    if (c.launched)
+    {
+        launchTime = std::max(now,
+            c.lastLaunch + std::chrono::milliseconds(launchIntervalMs));
+    }
+    c.launched = true;
+    c.lastLaunch = launchTime;
+
+    lock.unlock();
+    std::this_thread::sleep_until(launchTime);
+}
+
+Scheduler::TransferSlot::TransferSlot(Scheduler & scheduler,
+    const std::string & portPath)
+    : scheduler(scheduler), controller(controllerName(portPath))
+{
+    std::unique_lock<std::mutex> lock(scheduler.mutex);
+    Controller & c = scheduler.controllers[controller];
+    scheduler.transferDone.wait(lock, [&]() {
+        return c.activeTransfers < scheduler.maxPerController;
+    });
+    c.activeTransfers++;
+}
+
+Scheduler::TransferSlot::~TransferSlot()
+{
+    {
+        std::lock_guard<std::mutex> lock(scheduler.mutex);
+        scheduler.controllers[controller].activeTransfers--;
+    }
+    scheduler.transferDone.notify_all();
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <list>
+
+/* The Scheduler runs jobs that each operate on one USB device, using several
+ * threads, and it takes the USB topology into account so that many devices
+ * can be programmed at once without overloading the bus.
+ *
+ * Devices are grouped by host controller (the bus number at the start of the
+ * port path).  Within each group, jobs are ordered so that consecutive jobs
+ * are on different hubs, which spreads the load over the hubs' transaction
+ * translators.  Jobs call waitToLaunch() before starting a bootloader, so that
+ * devices on the same controller re-enumerate one at a time instead of all at
+ * once, and they hold a TransferSlot while talking to the device, which caps
+ * the number of devices transferring data on each controller.
+ *
+ * Each worker thread has a home controller and takes jobs from its queue.  A
+ * worker whose home queue is empty steals jobs from the controller with the
+ * most jobs waiting among those that have a free transfer slot, waiting for
+ * a slot to be freed if needed. */
+class Scheduler
+{
+public:
+    typedef std::function<void()> Job;
+
+    /* maxPerController is the number of devices on one host controller that
+     * can transfer data at the same time.  launchIntervalMs is the minimum
+     * time between bootloader launches on one host controller. */
+    Scheduler(uint32_t maxPerController, uint32_t launchIntervalMs);
+
+    // Waits for the jobs from startJob() to finish.
+    ~Scheduler();
+
+    Scheduler(const Scheduler &) = delete;
+    Scheduler & operator=(const Scheduler &) = delete;
+
+    /* Adds a job for the device plugged into the specified USB port.  An
+     * empty port path is allowed and puts the job in its own group. */
+    void addJob(const std::string & portPath, Job job);
+
+    /* Runs all the jobs and returns when they are finished.  Exceptions
+     * thrown by jobs are not caught, so jobs should handle their own
+     * errors. */
+    void run();
+
+    /* Starts running a job on a new thread right away, for jobs that are
+     * found while other jobs are running.  These jobs do not count toward
+     * run(), but they use the same launch spacing and transfer slots.  Call
+     * joinStartedJobs() to clean up the threads of jobs that are done. */
+    void startJob(Job job);
+
+    /* Waits for the jobs from startJob() that are done.  If wait is true,
+     * waits for all of them. */
+    void joinStartedJobs(bool wait);
+
+    /* Blocks until it is OK to launch a bootloader for the device on the
+     * specified port. */
+    void waitToLaunch(const std::string & portPath);
+
+    /* While a TransferSlot exists, it counts toward the limit of devices
+     * transferring data on the controller of its port. */
+    class TransferSlot
+    {
+    public:
+        TransferSlot(Scheduler & scheduler, const std::string & portPath);
+        ~TransferSlot();
+
+        TransferSlot(const TransferSlot &) = delete;
+        TransferSlot & operator=(const TransferSlot &) = delete;
+
+    private:
+        Scheduler & scheduler;
+        std::string controller;
+    };
+
+    /* Returns the name of the host controller for a port path, e.g. "1" for
+     * "1-2.3". */
+    static std::string controllerName(const std::string & portPath);
+
+    /* Returns the name of the hub a port belongs to, e.g. "1-2" for
+     * "1-2.3" or "1" for the root hub port "1-2". */
+    static std::string hubName(const std::string & portPath);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct QueuedJob
+    {
+        std::string hub;
+        Job job;
+    };
+
+    struct Controller
+    {
+        Controller() : activeTransfers(0), launched(false) { }
+
+        std::deque<QueuedJob> queue;
+        uint32_t activeTransfers;
+        bool launched;
+        Clock::time_point lastLaunch;
+    };
+
+    void worker(std::string home);
+    bool takeJob(const std::string & home, Job & job);
+    void orderQueue(std::deque<QueuedJob> & queue);
+
+    struct StartedJob
+    {
+        std::thread thread;
+        std::shared_ptr<std::atomic<bool>> done;
+    };
+
+    uint32_t maxPerController;
+    uint32_t launchIntervalMs;
+
+    std::list<StartedJob> startedJobs;
+
+    std::mutex mutex;
+    std::condition_variable transferDone;
+    std::map<std::string, Controller> controllers;
+};
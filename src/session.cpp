@@ -0,0 +1,218 @@
+#include "session.h"
+
+Session::Session()
+{
+    waitTimeout = 10;
+    listener = NULL;
+    restartFlag = false;
+    waitForAppFlag = false;
+}
+
+void Session::specifyUserType(const PloaderUserType & userType)
+{
+    userTypes.push_back(&userType);
+}
+
+void Session::specifySerialNumber(const std::string & str)
+{
+    serialNumberFilter = str;
+}
+
+void Session::specifyPortPath(const std::string & str)
+{
+    portPathFilter = str;
+}
+
+void Session::setWaitTimeout(uint32_t seconds)
+{
+    waitTimeout = seconds;
+}
+
+void Session::setStatusListener(PloaderStatusListener * listener)
+{
+    this->listener = listener;
+}
+
+void Session::write(std::shared_ptr<const FirmwareData> data, MemorySet ms)
+{
+    assert(data);
+    Operation operation = Operation();
+    operation.kind = Operation::WRITE;
+    operation.memorySet = ms;
+    operation.data = data;
+    operations.push_back(operation);
+}
+
+void Session::erase(MemorySet ms)
+{
+    Operation operation = Operation();
+    operation.kind = Operation::ERASE;
+    operation.memorySet = ms;
+    operations.push_back(operation);
+}
+
+void Session::read(MemorySet ms, IntelHex::Data & result)
+{
+    Operation operation = Operation();
+    operation.kind = Operation::READ;
+    operation.memorySet = ms;
+    operation.result = &result;
+    operations.push_back(operation);
+}
+
+void Session::restart(bool waitForApp)
+{
+    restartFlag = true;
+    waitForAppFlag = waitForApp;
+}
+
+void Session::clearOperations()
+{
+    operations.clear();
+    restartFlag = false;
+    waitForAppFlag = false;
+}
+
+void Session::run()
+{
+    // A DeviceSelector can only select a device once, so we make a new one
+    // each time.  User types must be specified before firmware data.
+    DeviceSelector selector;
+    for (const PloaderUserType * userType : userTypes)
+    {
+        selector.specifyUserType(*userType);
+    }
+    for (const Operation & operation : operations)
+    {
+        if (operation.kind == Operation::WRITE)
+        {
+            selector.specifyFirmwareData(*operation.data);
+        }
+    }
+    if (!serialNumberFilter.empty())
+    {
+        selector.specifySerialNumber(serialNumberFilter);
+    }
+    if (!portPathFilter.empty())
+    {
+        selector.specifyPortPath(portPathFilter);
+    }
+
+    PloaderAppInstance app = selector.selectAppToLaunchBootloader();
+    if (app)
+    {
+        lastSerialNumber = app.serialNumber;
+        app.launchBootloader();
+        selector.waitForBootloader(waitTimeout);
+    }
+
+    PloaderInstance instance = selector.selectBootloader();
+    lastSerialNumber = instance.serialNumber;
+
+    PloaderHandle handle(instance);
+    handle.setStatusListener(listener);
+
+    for (const Operation & operation : operations)
+    {
+        switch (operation.kind)
+        {
+        case Operation::WRITE:
+            operation.data->ensureBootloaderCompatibility(*handle.type,
+                operation.memorySet);
+            break;
+        case Operation::ERASE:
+            handle.type->ensureErasing(operation.memorySet);
+            break;
+        case Operation::READ:
+            handle.type->ensureReading(operation.memorySet);
+            break;
+        }
+    }
+
+    if (waitForAppFlag && handle.type->getMatchingAppTypes().empty())
+    {
+        throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+            std::string("Cannot wait for the app of the ") +
+            handle.type->name + " because its app cannot be recognized.");
+    }
+
+    execute(handle);
+
+    if (restartFlag)
+    {
+        handle.restartDevice();
+        handle.close();
+        selector.releaseDeviceLocks();
+
+        if (waitForAppFlag)
+        {
+            AppWaiter(instance).wait(waitTimeout);
+        }
+    }
+}
+
+// Runs the operations the same way the p-load executable runs its actions:
+// the writes and erases between reads are combined into one optimized plan,
+// and reads with no writes between them share the data they read.
+void Session::execute(PloaderHandle & handle)
+{
+    const PloaderType & type = *handle.type;
+    PloaderPlan plan;
+    MemoryImage flash, eeprom;
+
+    auto executePlan = [&]()
+    {
+        if (plan.steps.empty()) { return; }
+        plan.optimize();
+        handle.executePlan(plan);
+        plan = PloaderPlan();
+        flash.clear();
+        eeprom.clear();
+    };
+
+    for (const Operation & operation : operations)
+    {
+        MemorySet ms = operation.memorySet;
+        switch (operation.kind)
+        {
+        case Operation::WRITE:
+            plan.append(operation.data->getWritePlan(type, ms));
+            break;
+
+        case Operation::ERASE:
+            if (type.memorySetIncludesFlash(ms))
+            {
+                plan.initialize(type);
+                plan.eraseFlash();
+            }
+            if (type.memorySetIncludesEeprom(ms))
+            {
+                plan.eraseEeprom(type);
+            }
+            break;
+
+        case Operation::READ:
+            executePlan();
+            if (type.memorySetIncludesFlash(ms))
+            {
+                if (flash.empty())
+                {
+                    flash.resize(type.appSize);
+                    handle.readFlash(&flash[0]);
+                }
+                operation.result->setImage(type.appAddress, flash);
+            }
+            if (type.memorySetIncludesEeprom(ms))
+            {
+                if (eeprom.empty())
+                {
+                    eeprom.resize(type.eepromSize);
+                    handle.readEeprom(&eeprom[0]);
+                }
+                operation.result->setImage(type.eepromAddressHexFile, eeprom);
+            }
+            break;
+        }
+    }
+    executePlan();
+}
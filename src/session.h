@@ -0,0 +1,90 @@
+#pragma once
+
+#include "p-load.h"
+#include "ploader.h"
+#include "firmware_data.h"
+#include "intel_hex.h"
+
+/* A Session selects one device and runs operations on it, so other programs
+ * can do what the p-load executable does without starting a new process for
+ * each device.  Sessions do not share any state, so a program can run several
+ * of them at once from different threads, as long as each session is only
+ * used by one thread at a time.  A session can be run any number of times,
+ * and it selects the device again each time.
+ *
+ * Errors are reported by throwing ExceptionWithExitCode or
+ * std::runtime_error, like the rest of p-load. */
+class Session
+{
+public:
+    Session();
+
+    Session(const Session &) = delete;
+    Session & operator=(const Session &) = delete;
+
+    /** These functions restrict which devices can be selected, like the -t,
+     * -d, and -p options. */
+    void specifyUserType(const PloaderUserType &);
+    void specifySerialNumber(const std::string &);
+    void specifyPortPath(const std::string &);
+
+    /** Sets how long to wait for the bootloader to appear, and for the app to
+     * start if waitForApp is used.  The default is 10 seconds. */
+    void setWaitTimeout(uint32_t seconds);
+
+    /** Sets an object that is told about the progress of long operations.
+     * It is called from the thread that runs the session. */
+    void setStatusListener(PloaderStatusListener *);
+
+    /** Adds an operation that writes firmware to the device.  Several
+     * sessions can share the same data. */
+    void write(std::shared_ptr<const FirmwareData> data, MemorySet);
+
+    /** Adds an operation that erases memory on the device. */
+    void erase(MemorySet);
+
+    /** Adds an operation that reads memory from the device into the specified
+     * object, which must remain valid until the session is run. */
+    void read(MemorySet, IntelHex::Data & result);
+
+    /** Makes the session restart the device after the other operations.  If
+     * waitForApp is true, the session also waits for the app to start. */
+    void restart(bool waitForApp);
+
+    /** Removes the operations, so the session can be used to do something
+     * else.  The device selection and other settings are kept. */
+    void clearOperations();
+
+    /** Gets a device into bootloader mode and runs the operations on it. */
+    void run();
+
+    /** The serial number of the device used by the last call to run(). */
+    const std::string & serialNumber() const
+    {
+        return lastSerialNumber;
+    }
+
+private:
+    struct Operation
+    {
+        enum Kind { WRITE, ERASE, READ };
+        Kind kind;
+        MemorySet memorySet;
+        std::shared_ptr<const FirmwareData> data;
+        IntelHex::Data * result;
+    };
+
+    void execute(PloaderHandle &);
+
+    std::vector<const PloaderUserType *> userTypes;
+    std::string serialNumberFilter;
+    std::string portPathFilter;
+    uint32_t waitTimeout;
+    PloaderStatusListener * listener;
+
+    std::vector<Operation> operations;
+    bool restartFlag;
+    bool waitForAppFlag;
+
+    std::string lastSerialNumber;
+};
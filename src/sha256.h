@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+/* Computes SHA-256 hashes, which --snapshot uses to name the images it
+ * stores.  Call update() any number of times and then hexDigest(). */
+class Sha256
+{
+public:
+    Sha256();
+
+    void update(const void * data, size_t size);
+
+    // Finishes the hash and returns it as 64 lowercase hex digits.  The object
+    // cannot be updated after this.
+    std::string hexDigest();
+
+private:
+    void processBlock(const uint8_t * block);
+
+    uint32_t state[8];
+    uint8_t buffer[64];
+    size_t bufferSize;
+    uint64_t totalSize;
+};
@@ -0,0 +1,120 @@
+#include "p-load.h"
+#include "snapshot.h"
+#include "sha256.h"
+
+SnapshotStore::SnapshotStore(const std::string & directory)
+    : directory(directory)
+{
+    createDirectory(directory);
+}
+
+std::string SnapshotStore::add(PloaderHandle & handle,
+    const PloaderInstance & instance)
+{
+    const PloaderType & type = *handle.type;
+    if (!type.supportsFlashReading && !type.supportsEepromAccess)
+    {
+        throw std::runtime_error("This bootloader does not support reading memory.");
+    }
+
+    // A dash means the bootloader cannot read that memory.
+    std::string flashHash = "-";
+    std::string eepromHash = "-";
+
+    if (type.supportsFlashReading)
+    {
+        MemoryImage flash(type.appSize);
+        handle.readFlash(&flash[0]);
+        IntelHex::Data hexData;
+        hexData.setImage(type.appAddress, flash);
+        std::ostringstream hexText;
+        hexData.writeToFile(hexText);
+        flashHash = store(hexText.str());
+    }
+
+    if (type.supportsEepromAccess)
+    {
+        MemoryImage eeprom(type.eepromSize);
+        handle.readEeprom(&eeprom[0]);
+        IntelHex::Data hexData;
+        hexData.setImage(type.eepromAddressHexFile, eeprom);
+        std::ostringstream hexText;
+        hexData.writeToFile(hexText);
+        eepromHash = store(hexText.str());
+    }
+
+    std::string key = instance.serialNumber;
+    if (key.empty()) { key = "port " + instance.portPath; }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        manifestLines[key] = instance.serialNumber + "," + instance.portPath +
+            "," + type.name + "," + flashHash + "," + eepromHash;
+    }
+
+    // The first 12 digits are enough to tell the images apart by eye.
+    return "flash " + flashHash.substr(0, 12) + ", EEPROM " +
+        eepromHash.substr(0, 12);
+}
+
+void SnapshotStore::writeManifest()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::string fileName = directory + "/manifest.csv";
+    std::ofstream file(fileName);
+    if (!file)
+    {
+        int error_code = errno;
+        throw std::runtime_error(fileName + ": " + strerror(error_code) + ".");
+    }
+
+    file << "serial_number,port,type,flash,eeprom" << std::endl;
+    for (const auto & entry : manifestLines)
+    {
+        file << entry.second << std::endl;
+    }
+
+    if (!file)
+    {
+        throw std::runtime_error("Failed to write " + fileName + ".");
+    }
+}
+
+// Saves an image in the directory unless it is already there, and returns
+// its hash.
+std::string SnapshotStore::store(const std::string & hexText)
+{
+    Sha256 sha;
+    sha.update(hexText.data(), hexText.size());
+    std::string hash = sha.hexDigest();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (storedHashes.count(hash)) { return hash; }
+
+    // An earlier snapshot might have saved the same image.  Otherwise, write
+    // to a temporary file first, so an interrupted run does not leave a file
+    // whose contents do not match its name.
+    std::string fileName = directory + "/" + hash + ".hex";
+    if (!std::ifstream(fileName))
+    {
+        std::string tmpFileName = fileName + ".tmp";
+        {
+            std::ofstream file(tmpFileName, std::ios::binary);
+            file << hexText;
+            file.close();
+            if (!file)
+            {
+                throw std::runtime_error("Failed to write " + tmpFileName + ".");
+            }
+        }
+        if (std::rename(tmpFileName.c_str(), fileName.c_str()))
+        {
+            int error_code = errno;
+            throw std::runtime_error(fileName + ": " + strerror(error_code) + ".");
+        }
+    }
+
+    storedHashes.insert(hash);
+    return hash;
+}
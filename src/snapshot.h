@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <set>
+#include <mutex>
+
+class PloaderHandle;
+class PloaderInstance;
+
+/* A SnapshotStore saves the memory of many devices in one directory, for
+ * --snapshot.  Each image is saved as a HEX file named after the SHA-256 hash
+ * of its contents, so devices with the same firmware share one file, and the
+ * manifest lists the hashes for each device.  It is safe to use from the
+ * scheduler's threads. */
+class SnapshotStore
+{
+public:
+    // Creates the directory if needed.
+    SnapshotStore(const std::string & directory);
+
+    SnapshotStore(const SnapshotStore &) = delete;
+    SnapshotStore & operator=(const SnapshotStore &) = delete;
+
+    // Reads the flash and EEPROM that the bootloader can read, stores them,
+    // and returns a short message with their hashes.
+    std::string add(PloaderHandle &, const PloaderInstance &);
+
+    // Writes manifest.csv, with one line per device added, sorted by serial
+    // number.
+    void writeManifest();
+
+private:
+    std::string store(const std::string & hexText);
+
+    std::string directory;
+    std::mutex mutex;
+    std::set<std::string> storedHashes;
+    std::map<std::string, std::string> manifestLines;
+};